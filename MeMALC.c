@@ -1,11 +1,22 @@
 #include <errno.h>
 #include <pthread.h>
+#include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef PERF_COUNTERS
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif // PERF_COUNTERS
+
 #include "myMalloc.h"
 #include "printing.h"
 
@@ -29,19 +40,55 @@ inline static void assert(int e) {
 /*
  * Mutex to ensure thread safety for the freelist
  */
-static pthread_mutex_t mutex;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /*
  * Array of sentinel nodes for the freelists
  */
 header freelistSentinels[N_LISTS];
 
+/*
+ * A set of segregated freelists: the sentinels, how many of them are in use
+ * and the base their links are relative to (see header_to_link). The main
+ * heap and the shared memory heaps run the same freelist code over their own
+ * set.
+ */
+typedef struct freelist_set {
+  header * sentinels;
+  size_t num_lists;
+  char * link_base;
+  // Block a paused heap walk resumes from (see my_heap_walk), moved to the
+  // surviving block when it is merged away
+  header * walk_cursor;
+} freelist_set;
+
+/*
+ * Freelists of the main heap, completed by init
+ */
+static freelist_set heapLists = { freelistSentinels, N_LISTS, NULL, NULL };
+
 /*
  * Pointer to the second fencepost in the most recently allocated chunk from
  * the OS. Used for coalescing chunks
  */
 header * lastFencePost;
-static void NEW_CHUNK_ADDER();
+static bool NEW_CHUNK_ADDER(size_t actual_size);
+
+/*
+ * Number of bytes requested from the OS the next time the heap grows. It
+ * doubles on every growth until it reaches MAX_HEAP_GROWTH
+ */
+static size_t heapGrowth = ARENA_SIZE;
+#define MAX_HEAP_GROWTH (4096 * ARENA_SIZE)
+
+/*
+ * Runtime tunables. They start at the compile time defaults and are set
+ * from the MEMALC_CONF environment variable and my_mallopt (see MeMALC.h)
+ */
+static size_t arenaSize = ARENA_SIZE;
+static size_t maxHeapGrowth = MAX_HEAP_GROWTH;
+static size_t numLists = N_LISTS;
+static bool isConfigLoaded;
 /*
  * Pointer to maintian the base of the heap to allow printing based on the
  * distance from the base of the heap
@@ -55,10 +102,133 @@ header * osChunkList [MAX_OS_CHUNKS];
 size_t numOsChunks = 0;
 
 /*
- * direct the compiler to run the init function before running main
- * this allows initialization of required globals
+ * Right fencepost of each chunk in osChunkList, recorded once the next chunk
+ * starts. Only the last chunk grows, it ends at lastFencePost
+ */
+static header * osChunkEnds[MAX_OS_CHUNKS];
+
+/*
+ * First and right fencepost of a chunk beyond the first MAX_OS_CHUNKS
+ */
+typedef struct os_chunk {
+  header * start;
+  header * end;
+} os_chunk;
+
+/*
+ * Chunks beyond the first MAX_OS_CHUNKS. The array is mapped directly from
+ * the OS and doubled when full so the heap walker sees every chunk
+ */
+static os_chunk * osChunkOverflow;
+static size_t numOverflowChunks = 0;
+static size_t overflowCapacity = 0;
+
+/*
+ * A block of memory owned by a region. Blocks are allocated from the heap
+ * with my_malloc and chained from newest to oldest through prev
+ */
+typedef struct region_block {
+  struct region_block * prev;
+  char * end;
+  char data[0];
+} region_block;
+
+/*
+ * State of a region: the newest block and the bump cursor inside of it
+ */
+struct my_region {
+  region_block * current;
+  char * cursor;
+  size_t block_size;
+};
+
+/* Default size of the blocks a region takes from the heap */
+#define REGION_BLOCK_SIZE (16 * arenaSize)
+
+/*
+ * Heap walks hold the heap lock for at most WALK_BATCH blocks at a time and
+ * are serialized by their own lock as they share the walk cursor
+ */
+#define WALK_BATCH 64
+
+static pthread_mutex_t walkMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Run of neighbouring blocks in the same state being collected for
+ * my_heap_dump, and the text waiting to be written
+ */
+typedef struct heap_dump_run {
+  int fd;
+  size_t chunk;
+  enum state state;
+  size_t bytes;
+  size_t blocks;
+  size_t len;
+  char text[4096];
+} heap_dump_run;
+
+/*
+ * Per thread buffer of pointers passed to my_free_deferred. The owning thread
+ * is the only producer. Consumers drain it while holding the heap mutex, so
+ * the ring needs no further synchronization. Buffers are mapped directly from
+ * the OS and handed to a new thread once their owner exits, which bounds
+ * their number by the peak number of live threads.
+ */
+#define DEFERRED_FREE_CAPACITY 256
+
+typedef struct deferred_buffer {
+  struct deferred_buffer * next;
+  bool owned;
+  size_t head;
+  size_t tail;
+  void * ptrs[DEFERRED_FREE_CAPACITY];
+} deferred_buffer;
+
+// Number of queued pointers that forces a flush, a runtime tunable
+static size_t deferredBatch = DEFERRED_FREE_CAPACITY;
+
+static __thread deferred_buffer * deferredBuffer;
+static deferred_buffer * deferredBuffers;
+static pthread_key_t deferredKey;
+static pthread_once_t deferredKeyOnce = PTHREAD_ONCE_INIT;
+
+/*
+ * A heap living in a shared mapping. Everything the allocator needs is kept
+ * inside the mapping and the start of the mapping is the link base of its
+ * freelists, so every process can map it at a different address. The chunk
+ * of blocks follows the sentinels.
+ */
+struct my_shm_heap {
+  uint64_t magic;
+  size_t size;
+  pthread_mutex_t mutex;
+  header sentinels[N_LISTS];
+  char chunk[] __attribute__ ((aligned (8)));
+};
+
+/* Identifies a heap and the header layout it was created with */
+#define SHM_HEAP_MAGIC (0x4d654d414c430000ull | (RELATIVE_POINTERS << 8) | N_LISTS)
+
+// The mapping is a single chunk so it is bounded by the size of a block
+#define SHM_MAX_SIZE MAX_BLOCK_SIZE
+
+/*
+ * Live bytes and blocks per allocation tag, and the tag charged by
+ * allocations of the current thread that do not name one
+ */
+static my_tag_stats tagStats[MAX_ALLOC_TAGS];
+static __thread unsigned allocTag;
+
+/*
+ * State of the optional background reclaimer thread. Shorter intervals than
+ * MIN_RECLAIMER_INTERVAL microseconds are raised to it so the thread never
+ * spins on the heap lock
  */
-static void init (void) __attribute__ ((constructor));
+#define MIN_RECLAIMER_INTERVAL 100
+
+static pthread_t reclaimerThread;
+static bool reclaimerRunning;
+static unsigned reclaimerInterval;
 
 // Helper functions for manipulating pointers to headers
 static inline header * get_header_from_offset(void * ptr, ptrdiff_t off);
@@ -68,15 +238,32 @@ static inline header * ptr_to_header(void * p);
 // Helper functions for allocating more memory from the OS
 static inline void initialize_fencepost(header * fp, size_t left_size);
 static inline void insert_os_chunk(header * hdr);
+static void insert_overflow_chunk(header * hdr);
+static inline size_t get_num_os_chunks();
+static inline header * get_os_chunk(size_t i);
+static inline header * get_os_chunk_end(size_t i);
 static inline void insert_fenceposts(void * raw_mem, size_t size);
 static header * allocate_chunk(size_t size);
 
 // Helper functions for freeing a block
 static inline void deallocate_object(void * p);
+static void shrink_object(void * p, size_t raw_size);
 
 // Helper functions for allocating a block
 static inline header * allocate_object(size_t raw_size);
 
+// Helper functions for maintaining a set of freelists
+static inline header * list_next(freelist_set * lists, header * h);
+static inline header * list_prev(freelist_set * lists, header * h);
+static inline void list_set_next(freelist_set * lists, header * h, header * next);
+static inline void list_set_prev(freelist_set * lists, header * h, header * prev);
+static inline size_t get_freelist_index(freelist_set * lists, size_t size);
+static inline void insert_free_block(freelist_set * lists, header * block);
+static inline void remove_free_block(freelist_set * lists, header * block);
+static inline header * find_free_block(freelist_set * lists, size_t actual_size);
+static inline header * split_free_block(freelist_set * lists, header * block, size_t actual_size);
+static inline header * coalesce_free_block(freelist_set * lists, header * block);
+
 // Helper functions for verifying that the data structures are structurally 
 // valid
 static inline header * detect_cycles();
@@ -85,10 +272,156 @@ static inline bool verify_freelist();
 static inline header * verify_chunk(header * chunk);
 static inline bool verify_tags();
 
-static void init();
+// Helper functions for walking the heap
+static size_t walk_batch(size_t index, my_heap_block * batch);
+static void heap_dump_append(heap_dump_run * run, const char * fmt, ...);
+static void heap_dump_write(heap_dump_run * run);
+static void heap_dump_flush(heap_dump_run * run);
+static bool heap_dump_block(const my_heap_block * block, void * ctx);
+
+// Helper functions for deferred frees
+static deferred_buffer * deferred_buffer_get();
+static int compare_pointers(const void * a, const void * b);
+static void drain_deferred(deferred_buffer * b);
+static void release_deferred_buffer(void * arg);
+static void * reclaimer_main(void * arg);
+
+// Helper functions for shared memory heaps
+static inline freelist_set shm_lists(my_shm_heap * heap);
+static bool shm_verify(my_shm_heap * heap);
+static int shm_lock(my_shm_heap * heap);
+
+// Helper functions for tagged allocation accounting
+static inline void account_allocation(void * p, unsigned tag);
+static inline void account_free(header * hdr);
+static void * locked_allocate(size_t size, unsigned tag);
+
+// Helper functions for reserving memory ahead of time
+static void prefault_block(header * top);
+static void presplit_top(size_t budget);
 
+// Helper functions for the region allocator
+static inline char * align_up(char * ptr, size_t align);
+static region_block * region_push_block(my_region * r, size_t min_size);
+static void region_release_blocks(region_block * block, region_block * stop);
+
+// Helper functions for runtime configuration
+static bool set_tunable(int param, size_t value);
+static void load_config();
+
+static bool init();
+static void create_deferred_key();
+
+/*
+ * The heap is set up lazily by the first allocation rather than by a
+ * constructor, so processes that never allocate never touch the brk
+ */
 static bool isMallocInitialized;
 
+/*
+ * Optional hardware performance counter instrumentation
+ *
+ * When built with -DPERF_COUNTERS the allocator hot paths are bracketed by
+ * reads of a per thread perf_event_open counter group. Totals are kept per
+ * thread, per instrumented site and per freelist bin and can be exported
+ * with my_perf_dump. Nested sites (NEW_CHUNK_ADDER inside allocate_object)
+ * are counted inclusively.
+ *
+ * The counters are read with read(2) on entry and on exit of every site, so
+ * an instrumented my_malloc or my_free makes four extra system calls (two for
+ * the lock and two for the allocator itself) and a heap growth two more.
+ * Deltas include part of the cost of their own reads and the lock is held
+ * longer, so compare wall clock times against a build without PERF_COUNTERS
+ * rather than trusting the counters for absolute costs. rdpmc would avoid the
+ * system calls but cannot read the software page fault counter and is often
+ * disabled in virtual machines.
+ */
+#ifdef PERF_COUNTERS
+
+enum perf_site {
+  PERF_SITE_ALLOCATE = 0,
+  PERF_SITE_DEALLOCATE = 1,
+  PERF_SITE_CHUNK_ADDER = 2,
+  PERF_SITE_LOCK = 3,
+  N_PERF_SITES = 4,
+};
+
+enum perf_counter {
+  PERF_PAGE_FAULTS = 0,
+  PERF_CYCLES = 1,
+  PERF_INSTRUCTIONS = 2,
+  PERF_L1D_MISSES = 3,
+  PERF_LLC_MISSES = 4,
+  N_PERF_COUNTERS = 5,
+};
+
+static const char * const perfSiteNames[N_PERF_SITES] = {
+  "allocate_object", "deallocate_object", "NEW_CHUNK_ADDER", "lock",
+};
+
+/*
+ * Accumulated counter deltas for one site and bin
+ */
+typedef struct perf_totals {
+  uint64_t calls;
+  uint64_t counters[N_PERF_COUNTERS];
+} perf_totals;
+
+/*
+ * Counter group and totals of one thread. Records are mapped directly from
+ * the OS so that instrumenting the allocator never recurses into it. When a
+ * thread exits its counters are closed, its totals are added to
+ * perfExitedTotals and the record is handed to the next new thread, which
+ * bounds their number by the peak number of live threads.
+ */
+typedef struct perf_thread {
+  struct perf_thread * next;
+  bool owned;
+  pid_t tid;
+  int group_fd;
+  // File descriptor of each counter or -1 if it could not be opened
+  int fds[N_PERF_COUNTERS];
+  // Position of each counter in a group read or -1 if it could not be opened
+  int slot[N_PERF_COUNTERS];
+  int num_slots;
+  perf_totals totals[N_PERF_SITES][N_LISTS];
+} perf_thread;
+
+static __thread perf_thread * perfThread;
+static perf_thread * perfThreads;
+static pthread_key_t perfKey;
+static pthread_once_t perfKeyOnce = PTHREAD_ONCE_INIT;
+
+/*
+ * Totals of every thread that has exited, and which counters any of them had
+ */
+static perf_totals perfExitedTotals[N_PERF_SITES][N_LISTS];
+static bool perfExitedCounters[N_PERF_COUNTERS];
+
+static perf_thread * perf_thread_get();
+static void create_perf_key();
+static void release_perf_thread(void * arg);
+static inline bool perf_read(perf_thread * t, uint64_t * values);
+static inline void perf_begin(uint64_t * start);
+static inline void perf_end(enum perf_site site, size_t bin, uint64_t * start);
+static inline size_t perf_request_bin(size_t raw_size);
+static inline size_t perf_block_bin(void * p);
+static void perf_dump_totals(int fd, const char * tid, int site, int bin, perf_totals * totals,
+		const int * slot);
+
+#define PERF_MEASURE(site, bin, stmt) \
+		do { \
+				size_t perf_bin_ = (bin); \
+				uint64_t perf_start_[N_PERF_COUNTERS + 1]; \
+				perf_begin(perf_start_); \
+				stmt; \
+				perf_end(site, perf_bin_, perf_start_); \
+		} while (0)
+
+#else
+#define PERF_MEASURE(site, bin, stmt) stmt
+#endif // PERF_COUNTERS
+
 /**
  * @brief Helper function to retrieve a header pointer from a pointer and an 
  *        offset
@@ -121,7 +454,7 @@ header * get_right_header(header * h) {
  * @return header to the right of h
  */
 inline static header * get_left_header(header * h) {
-		return get_header_from_offset(h, -h->left_size);
+		return get_header_from_offset(h, -get_left_size(h));
 }
 
 /**
@@ -134,7 +467,7 @@ inline static header * get_left_header(header * h) {
 inline static void initialize_fencepost(header * fp, size_t left_size) {
 		set_block_state(fp,FENCEPOST);
 		set_block_size(fp, ALLOC_HEADER_SIZE);
-		fp->left_size = left_size;
+		set_left_size(fp, left_size);
 }
 
 /**
@@ -143,9 +476,77 @@ inline static void initialize_fencepost(header * fp, size_t left_size) {
  * @param hdr the first fencepost in the chunk allocated by the OS
  */
 inline static void insert_os_chunk(header * hdr) {
+		// The previous chunk stops growing once a new one starts
+		size_t count = get_num_os_chunks();
+		if (count > MAX_OS_CHUNKS) {
+				osChunkOverflow[count - 1 - MAX_OS_CHUNKS].end = lastFencePost;
+		}
+		else if (count > 0) {
+				osChunkEnds[count - 1] = lastFencePost;
+		}
 		if (numOsChunks < MAX_OS_CHUNKS) {
 				osChunkList[numOsChunks++] = hdr;
 		}
+		else {
+				insert_overflow_chunk(hdr);
+		}
+}
+
+/**
+ * @brief Helper to record a chunk once osChunkList is full
+ *
+ * @param hdr the first fencepost in the chunk allocated by the OS
+ */
+static void insert_overflow_chunk(header * hdr) {
+		if (numOverflowChunks == overflowCapacity) {
+				size_t capacity = overflowCapacity ? 2 * overflowCapacity : MAX_OS_CHUNKS;
+				os_chunk * list = mmap(NULL, capacity * sizeof(os_chunk), PROT_READ | PROT_WRITE,
+								MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (list == MAP_FAILED) {
+						return;
+				}
+				if (osChunkOverflow != NULL) {
+						memcpy(list, osChunkOverflow, numOverflowChunks * sizeof(os_chunk));
+						munmap(osChunkOverflow, overflowCapacity * sizeof(os_chunk));
+				}
+				osChunkOverflow = list;
+				overflowCapacity = capacity;
+		}
+		osChunkOverflow[numOverflowChunks].start = hdr;
+		osChunkOverflow[numOverflowChunks].end = NULL;
+		numOverflowChunks++;
+}
+
+/**
+ * @brief Helper to get the number of chunks recorded from the OS
+ *
+ * @return number of chunks in osChunkList and the overflow list
+ */
+static inline size_t get_num_os_chunks() {
+		return numOsChunks + numOverflowChunks;
+}
+
+/**
+ * @brief Helper to get a recorded chunk by index
+ *
+ * @param i index of the chunk, less than get_num_os_chunks()
+ *
+ * @return the first fencepost of the chunk
+ */
+static inline header * get_os_chunk(size_t i) {
+		return i < MAX_OS_CHUNKS ? osChunkList[i] : osChunkOverflow[i - MAX_OS_CHUNKS].start;
+}
+
+/**
+ * @brief Helper to get the end of a recorded chunk without walking it
+ *
+ * @param i index of the chunk, less than get_num_os_chunks()
+ *
+ * @return the right fencepost of the chunk
+ */
+static inline header * get_os_chunk_end(size_t i) {
+		header * end = i < MAX_OS_CHUNKS ? osChunkEnds[i] : osChunkOverflow[i - MAX_OS_CHUNKS].end;
+		return end != NULL ? end : lastFencePost;
 }
 
 /**
@@ -176,23 +577,24 @@ inline static void insert_fenceposts(void * raw_mem, size_t size) {
  * @param size The size to allocate from the OS
  *
  * @return A pointer to the allocable block in the chunk (just after the 
- * first fencpost)
+ * first fencpost) or NULL if the OS refused to grow the heap
  */
 static header * allocate_chunk(size_t size) {
 		void * mem = sbrk(size);
+		if (mem == (void *) -1) {
+				return NULL;
+		}
 		insert_fenceposts(mem, size);
 		header * hdr = (header *) ((char *)mem + ALLOC_HEADER_SIZE);
 		set_block_state(hdr, UNALLOCATED);
 		set_block_size(hdr, size - 2 * ALLOC_HEADER_SIZE);
-		hdr->left_size = ALLOC_HEADER_SIZE;
+		set_left_size(hdr, ALLOC_HEADER_SIZE);
 		return hdr;
 }
 
 // Function to allocate full block
 static header * SAME_SIZE_ALLOCATOR(header *block_ptr) {
-		// Changing previous pointers and state of block
-		block_ptr->next->prev = block_ptr->prev;
-		block_ptr->prev->next = block_ptr->next;
+		remove_free_block(&heapLists, block_ptr);
 		set_block_state(block_ptr, ALLOCATED);
 		block_ptr = get_header_from_offset(block_ptr, ALLOC_HEADER_SIZE);
 		return block_ptr;
@@ -200,49 +602,25 @@ static header * SAME_SIZE_ALLOCATOR(header *block_ptr) {
 
 // Function to allocate part of a bigger block
 static header * LARGER_SIZE_ALLOCATOR(header *block_ptr, size_t actual_size) {
-		header *return_ptr;
 		size_t diff = get_block_size(block_ptr) - actual_size;
 		// If size not big enough, allocating whole block
 		if (diff < 2 * ALLOC_HEADER_SIZE) {
 				return SAME_SIZE_ALLOCATOR(block_ptr);
 		}
-		// Setting the values for block
-		return_ptr = get_header_from_offset(block_ptr, get_block_size(block_ptr) - actual_size);
-		set_block_state(return_ptr, ALLOCATED);
-		set_block_size(return_ptr, actual_size);
-		set_block_size(block_ptr, diff);
-		return_ptr->left_size = diff;
-		// Calculating the index
-		diff -= ALLOC_HEADER_SIZE;
-		diff /= 8;
-		diff--;
-		header *start_ptr;
-		// If not in last index
-		if (diff < N_LISTS - 1) {
-				// Changing previous pointers
-				start_ptr = &freelistSentinels[diff];
-				block_ptr->next->prev = block_ptr->prev;
-				block_ptr->prev->next = block_ptr->next;
-				// Checking if list empty
-				if (start_ptr->next == start_ptr && start_ptr->prev == start_ptr) {
-						start_ptr->next = block_ptr;
-						start_ptr->prev = block_ptr;
-						block_ptr->next = start_ptr;
-						block_ptr->prev = start_ptr;
-				}
-				// or not
-				else{
-						block_ptr->next = start_ptr->next;
-						start_ptr->next = block_ptr;
-						block_ptr->next->prev = block_ptr;
-						block_ptr->prev = start_ptr;
-				}
-		}
-		// Updating values of block to right
-		header *right_block = get_header_from_offset(return_ptr, get_block_size(return_ptr));
-		right_block->left_size = get_block_size(return_ptr);
-		return_ptr = get_header_from_offset(return_ptr, ALLOC_HEADER_SIZE);
-		return return_ptr;
+		// Carve the top block from its low end so its free space stays against
+		// the last fencepost and merges with the next growth of the heap
+		if (get_right_header(block_ptr) == lastFencePost) {
+				remove_free_block(&heapLists, block_ptr);
+				set_block_size_and_state(block_ptr, actual_size, ALLOCATED);
+				header * top = get_header_from_offset(block_ptr, actual_size);
+				set_block_size_and_state(top, diff, UNALLOCATED);
+				set_left_size(top, actual_size);
+				set_left_size(lastFencePost, diff);
+				insert_free_block(&heapLists, top);
+				return get_header_from_offset(block_ptr, ALLOC_HEADER_SIZE);
+		}
+		header *return_ptr = split_free_block(&heapLists, block_ptr, actual_size);
+		return get_header_from_offset(return_ptr, ALLOC_HEADER_SIZE);
 }
 /**
  * @brief Helper allocate an object given a raw request size from the user
@@ -255,6 +633,11 @@ static inline header * allocate_object(size_t raw_size) {
 		size_t actual_size;
 		if (raw_size == 0)
 				return NULL;
+		// Refusing requests whose block size could not be stored
+		if (raw_size > MAX_BLOCK_SIZE - ALLOC_HEADER_SIZE) {
+				errno = ENOMEM;
+				return NULL;
+		}
 		// Increasing raw_size if less than smallest allocable size
 		if (raw_size < ALLOC_HEADER_SIZE)
 				raw_size = ALLOC_HEADER_SIZE;
@@ -268,179 +651,256 @@ static inline header * allocate_object(size_t raw_size) {
 				extra_mem = 8 - remainder;
 				actual_size += extra_mem; 
 		}
-		int i;
-		bool BREAK = false;
-		// Calculating index
-		header *block_ptr = NULL;
-		i = actual_size - ALLOC_HEADER_SIZE;
-		i /= 8;
-		i--;
-		for (i = i; i < N_LISTS - 1; i++) {
-				header *freelist_ptr = &freelistSentinels[i];
-				// if not an empty list
-				if (freelist_ptr->next != freelist_ptr && freelist_ptr->prev != freelist_ptr) {
-						freelist_ptr = freelist_ptr->next;
-						// If same size block
-						if (get_block_size(freelist_ptr) == actual_size) {
-								block_ptr = freelist_ptr;
-								return SAME_SIZE_ALLOCATOR(block_ptr);
+		header *block_ptr = find_free_block(&heapLists, actual_size);
+		// If no allocations, add new chunk
+		if (block_ptr == NULL) {
+				bool grown;
+				PERF_MEASURE(PERF_SITE_CHUNK_ADDER, perf_request_bin(raw_size),
+								grown = NEW_CHUNK_ADDER(actual_size));
+				return grown ? allocate_object(raw_size) : NULL;
+		}
+		// If same size block
+		if (get_block_size(block_ptr) == actual_size) {
+				return SAME_SIZE_ALLOCATOR(block_ptr);
+		}
+		// or greater size block
+		return LARGER_SIZE_ALLOCATOR(block_ptr, actual_size);
+}
+
+/**
+ * @brief Helpers to follow and update the links of a block in a set of
+ *        freelists
+ */
+static inline header * list_next(freelist_set * lists, header * h) {
+		return link_to_header(lists->link_base, h->next);
+}
+
+static inline header * list_prev(freelist_set * lists, header * h) {
+		return link_to_header(lists->link_base, h->prev);
+}
+
+static inline void list_set_next(freelist_set * lists, header * h, header * next) {
+		h->next = header_to_link(lists->link_base, next);
+}
+
+static inline void list_set_prev(freelist_set * lists, header * h, header * prev) {
+		h->prev = header_to_link(lists->link_base, prev);
+}
+
+/**
+ * @brief Helper to find the freelist a free block belongs in
+ *
+ * @param lists the set of freelists
+ * @param size size of the block including metadata
+ *
+ * @return index of the freelist
+ */
+static inline size_t get_freelist_index(freelist_set * lists, size_t size) {
+		size_t index = (size - ALLOC_HEADER_SIZE) / 8 - 1;
+		return index < lists->num_lists - 1 ? index : lists->num_lists - 1;
+}
+
+/**
+ * @brief Helper to push a free block onto the front of its freelist
+ *
+ * @param lists the set of freelists
+ * @param block the free block to insert
+ */
+static inline void insert_free_block(freelist_set * lists, header * block) {
+		header * sent_ptr = &lists->sentinels[get_freelist_index(lists, get_block_size(block))];
+		list_set_next(lists, block, list_next(lists, sent_ptr));
+		list_set_prev(lists, block, sent_ptr);
+		list_set_prev(lists, list_next(lists, sent_ptr), block);
+		list_set_next(lists, sent_ptr, block);
+}
+
+/**
+ * @brief Helper to unlink a free block from its freelist
+ *
+ * @param lists the set of freelists
+ * @param block the free block to remove
+ */
+static inline void remove_free_block(freelist_set * lists, header * block) {
+		list_set_prev(lists, list_next(lists, block), list_prev(lists, block));
+		list_set_next(lists, list_prev(lists, block), list_next(lists, block));
+}
+
+/**
+ * @brief Helper to find a free block of at least actual_size. Every block in
+ *        a small list has the same size so checking the first one is enough,
+ *        the last list is searched first fit
+ *
+ * @param lists the set of freelists
+ * @param actual_size size of the block needed including metadata
+ *
+ * @return the free block, still in its freelist, or NULL if none fits
+ */
+static inline header * find_free_block(freelist_set * lists, size_t actual_size) {
+		for (size_t i = get_freelist_index(lists, actual_size); i < lists->num_lists; i++) {
+				header * freelist = &lists->sentinels[i];
+				for (header * cur = list_next(lists, freelist); cur != freelist; cur = list_next(lists, cur)) {
+						if (get_block_size(cur) >= actual_size) {
+								return cur;
 						}
-						// or greater size block
-						else if (get_block_size(freelist_ptr) > actual_size) {
-								block_ptr = freelist_ptr;
-								return LARGER_SIZE_ALLOCATOR(block_ptr, actual_size);
+						if (i < lists->num_lists - 1) {
+								break;
 						}
 				}
 		}
-		// If no allocations, check last list
-		header *freelist_ptr = &freelistSentinels[N_LISTS - 1];
-		// If list empty
-		if (freelist_ptr->next == freelist_ptr && freelist_ptr->prev == freelist_ptr) {
-				// Add new chunk
-				NEW_CHUNK_ADDER(raw_size, actual_size);
-				return allocate_object(raw_size);
-		}
-		header *start_ptr = freelist_ptr;
-		freelist_ptr = freelist_ptr->next;
-		// Loop to get appropriate sized block
-		while (freelist_ptr != start_ptr) {
-				// If same size
-				if (get_block_size(freelist_ptr) == actual_size) { 
-						return SAME_SIZE_ALLOCATOR(freelist_ptr);
-				}
-				// or larger size
-				else if (get_block_size(freelist_ptr) > actual_size) {
-						return LARGER_SIZE_ALLOCATOR(freelist_ptr, actual_size);
-				}
-				freelist_ptr = freelist_ptr->next;
-		}
-		// If no allocations, check last list
-		NEW_CHUNK_ADDER(raw_size, actual_size);
-		return allocate_object(raw_size);
-}
-
-// Function to allocate new chunk
-static void NEW_CHUNK_ADDER(size_t raw_size, size_t actual_size) {
-		int numChunks = ARENA_SIZE;
-		bool MERGE = false;
-		// Getting the number of chunks
-		while (numChunks < actual_size + 2 * ALLOC_HEADER_SIZE) {
-				numChunks += ARENA_SIZE;
-		}
-		header *next_chunk;
-		numChunks /= ARENA_SIZE;
-		// Allocate first chunk
-		header *chunk_hdr = allocate_chunk(ARENA_SIZE);
-		header *left_FP = get_header_from_offset(chunk_hdr, -ALLOC_HEADER_SIZE);
-		header *right_FP = get_header_from_offset(chunk_hdr, get_block_size(chunk_hdr));
-		header *last_block = get_header_from_offset(lastFencePost, -(lastFencePost->left_size));
-		size_t last_block_size = get_block_size(last_block);
-		// Check if both chunks are contigious
-		if (get_header_from_offset(lastFencePost, ALLOC_HEADER_SIZE) == left_FP) 
-				MERGE = true;
-		if (MERGE)
-				lastFencePost = right_FP;
-		// Allocating remaining chunks
-		for(int i = 1; i < numChunks; i++) {
-				next_chunk = allocate_chunk(ARENA_SIZE);
-				right_FP = get_header_from_offset(right_FP, ARENA_SIZE);
-		}
-		// If both are contigious
-		if (MERGE) {
-				lastFencePost = right_FP;
-				set_block_state(lastFencePost, FENCEPOST);
-				set_block_size(lastFencePost, ALLOC_HEADER_SIZE);
-				// If last block in main chunk is UNALLOCATED coalesce
-				if (get_block_state(last_block) == UNALLOCATED) {
-						size_t init_index = last_block_size;
-						init_index -= ALLOC_HEADER_SIZE;
-						init_index /= 8;
-						init_index--;
-						last_block_size += (numChunks * ARENA_SIZE);
-						set_block_size(last_block, last_block_size);
-						last_block_size -= ALLOC_HEADER_SIZE;
-						last_block_size /= 8;
-						last_block_size--;
-						if (last_block_size >= N_LISTS - 1)
-								last_block_size = N_LISTS - 1;
-						if (init_index != last_block_size) {
-								last_block->next->prev = last_block->prev;
-								last_block->prev->next = last_block->next;
-								header *sent_ptr = &freelistSentinels[last_block_size];
-								if (sent_ptr->next == sent_ptr) {
-										sent_ptr->next = last_block;
-										sent_ptr->prev = last_block;
-										last_block->next = sent_ptr;
-										last_block->prev = sent_ptr;
-								}
-								else {
-										last_block->next = sent_ptr->next;
-										last_block->prev = sent_ptr;
-										last_block->next->prev = last_block;
-										sent_ptr->next = last_block;
-								}
-						}
+		return NULL;
+}
+
+/**
+ * @brief Helper to allocate actual_size bytes of a free block. The high end
+ *        is split off unless the rest would be too small to be a free block,
+ *        the low end stays free and only moves if its freelist changes
+ *
+ * @param lists the set of freelists
+ * @param block a free block of at least actual_size in its freelist
+ * @param actual_size size of the block needed including metadata
+ *
+ * @return header of the allocated block
+ */
+static inline header * split_free_block(freelist_set * lists, header * block, size_t actual_size) {
+		size_t size = get_block_size(block);
+		size_t diff = size - actual_size;
+		if (diff < 2 * ALLOC_HEADER_SIZE) {
+				remove_free_block(lists, block);
+				set_block_state(block, ALLOCATED);
+				return block;
+		}
+		set_block_size(block, diff);
+		if (get_freelist_index(lists, diff) != get_freelist_index(lists, size)) {
+				remove_free_block(lists, block);
+				insert_free_block(lists, block);
+		}
+		header * allocated = get_header_from_offset(block, diff);
+		set_block_size_and_state(allocated, actual_size, ALLOCATED);
+		set_left_size(allocated, diff);
+		set_left_size(get_right_header(allocated), actual_size);
+		return allocated;
+}
+
+/**
+ * @brief Helper to merge a block that was just marked free with its free
+ *        neighbours and insert the result in the freelist matching its size
+ *
+ * @param lists the set of freelists
+ * @param block the block to insert, not in any freelist yet
+ *
+ * @return header of the merged block
+ */
+static inline header * coalesce_free_block(freelist_set * lists, header * block) {
+		header * left_block = get_left_header(block);
+		header * right_block = get_right_header(block);
+		// Covering |?||A||U|: absorb the free right neighbour. Neighbours stay
+		// apart when the merged block would be too large to describe
+		if (get_block_state(right_block) == UNALLOCATED &&
+						get_block_size(right_block) <= MAX_BLOCK_SIZE - get_block_size(block)) {
+				remove_free_block(lists, right_block);
+				set_block_size(block, get_block_size(block) + get_block_size(right_block));
+				if (lists->walk_cursor == right_block) {
+						lists->walk_cursor = block;
 				}
-				// Else add the chunk to freelist
-				else {
-						chunk_hdr = get_header_from_offset(chunk_hdr, - 2 * ALLOC_HEADER_SIZE);
-						set_block_size(chunk_hdr, numChunks * ARENA_SIZE);
-						set_block_state(chunk_hdr, UNALLOCATED);
-						chunk_hdr->left_size = last_block_size;
-						size_t index = get_block_size(chunk_hdr);
-						index -= ALLOC_HEADER_SIZE;
-						index /= 8;
-						index--;
-						header * sent_ptr;
-						if (index < N_LISTS - 1) {
-								sent_ptr = &freelistSentinels[index];
-						}
-						else {
-								sent_ptr = &freelistSentinels[N_LISTS - 1];
-						}
-						if (sent_ptr->next == sent_ptr) {
-								sent_ptr->next = chunk_hdr;
-								sent_ptr->prev = chunk_hdr;
-								chunk_hdr->next = sent_ptr;
-								chunk_hdr->prev = sent_ptr;
-						}
-						else {
-								chunk_hdr->next = sent_ptr->next;
-								chunk_hdr->prev = sent_ptr;
-								chunk_hdr->next->prev = chunk_hdr;
-								sent_ptr->next = chunk_hdr;
-						}
+		}
+		// Covering |U||A||?|: the free left neighbour absorbs the block
+		if (get_block_state(left_block) == UNALLOCATED &&
+						get_block_size(left_block) <= MAX_BLOCK_SIZE - get_block_size(block)) {
+				remove_free_block(lists, left_block);
+				set_block_size(left_block, get_block_size(left_block) + get_block_size(block));
+				if (lists->walk_cursor == block) {
+						lists->walk_cursor = left_block;
+				}
+				block = left_block;
+		}
+		// The merged block may belong in a different freelist than its parts
+		set_left_size(get_right_header(block), get_block_size(block));
+		insert_free_block(lists, block);
+		return block;
+}
+
+/**
+ * @brief Grow the heap so a block of actual_size can be allocated
+ *
+ * The heap grows geometrically: every call asks the OS for twice as much as
+ * the previous one (up to maxHeapGrowth) in a single sbrk. When the new
+ * memory directly follows the last chunk the old right fencepost is turned
+ * into free space and merged with the free block in front of it, so the last
+ * free block of the heap acts as a top block that requests are carved from.
+ * Fenceposts are only written at real chunk boundaries. A growth never
+ * exceeds MAX_BLOCK_SIZE or takes the heap further than MAX_HEAP_SPAN from
+ * base.
+ *
+ * @param actual_size size of the block that needs to fit
+ *
+ * @return false if the OS refused to grow the heap
+ */
+static bool NEW_CHUNK_ADDER(size_t actual_size) {
+		if (actual_size > MAX_BLOCK_SIZE - 2 * ALLOC_HEADER_SIZE) {
+				errno = ENOMEM;
+				return false;
+		}
+		// Room for the block and the two fenceposts of a new chunk
+		size_t size = actual_size + 2 * ALLOC_HEADER_SIZE;
+		size = (size + arenaSize - 1) / arenaSize * arenaSize;
+		size_t needed = size;
+		if (size < heapGrowth) {
+				size = heapGrowth;
+		}
+		// Fall back to the bare minimum near the limits of the header layout
+		size_t limit = MAX_BLOCK_SIZE / arenaSize * arenaSize;
+		size_t used = (char *) sbrk(0) - (char *) base;
+		if (size > limit || size > MAX_HEAP_SPAN - used) {
+				size = needed;
+		}
+		if (size > limit || size > MAX_HEAP_SPAN - used) {
+				errno = ENOMEM;
+				return false;
+		}
+		char * mem = sbrk(size);
+		if (mem == (void *) -1) {
+				errno = ENOMEM;
+				return false;
+		}
+		// Somebody else may have moved the brk since it was sampled
+		if ((size_t) (mem - (char *) base) > MAX_HEAP_SPAN - size) {
+				if (sbrk(0) == mem + size) {
+						sbrk(-(intptr_t) size);
 				}
+				errno = ENOMEM;
+				return false;
+		}
+		if (heapGrowth < maxHeapGrowth) {
+				heapGrowth *= 2;
 		}
-		// If the chunks are not contigious
-		if (!MERGE) {
-				set_block_size(chunk_hdr, (numChunks * ARENA_SIZE) - 2 * ALLOC_HEADER_SIZE);
-				set_block_state(chunk_hdr, UNALLOCATED);
-				chunk_hdr->left_size = ALLOC_HEADER_SIZE;
-				set_block_size(left_FP, ALLOC_HEADER_SIZE);
-				set_block_size(right_FP, ALLOC_HEADER_SIZE);
-				set_block_state(left_FP, FENCEPOST);
-				set_block_state(right_FP, FENCEPOST);
-				left_FP->left_size = ALLOC_HEADER_SIZE;
-				right_FP->left_size = get_block_size(chunk_hdr);
-				// Inserting the chunk in osChunkList
-				insert_os_chunk(left_FP);
-				header * sent_ptr = &freelistSentinels[N_LISTS - 1];
-				// If list is empty
-				if (sent_ptr->next == sent_ptr) {
-						sent_ptr->next = chunk_hdr;
-						sent_ptr->prev = chunk_hdr;
-						chunk_hdr->next = sent_ptr;
-						chunk_hdr->prev = sent_ptr;
-				}
-				// Else
-				else {
-						chunk_hdr->next = sent_ptr->next;
-						chunk_hdr->prev = sent_ptr;
-						chunk_hdr->next->prev = chunk_hdr;
-						sent_ptr->next = chunk_hdr;
+		// If the brk is still contiguous extend the last chunk over the old fencepost
+		if (get_header_from_offset(lastFencePost, ALLOC_HEADER_SIZE) == (header *) mem) {
+				header * block = lastFencePost;
+				header * last_block = get_left_header(block);
+				set_block_size_and_state(block, size, UNALLOCATED);
+				lastFencePost = get_header_from_offset(block, size);
+				if (get_block_state(last_block) == UNALLOCATED &&
+								get_block_size(last_block) <= MAX_BLOCK_SIZE - size) {
+						remove_free_block(&heapLists, last_block);
+						set_block_size(last_block, get_block_size(last_block) + size);
+						if (heapLists.walk_cursor == block) {
+								heapLists.walk_cursor = last_block;
+						}
+						block = last_block;
 				}
+				initialize_fencepost(lastFencePost, get_block_size(block));
+				insert_free_block(&heapLists, block);
+				return true;
 		}
+		// Otherwise start a new chunk with its own fenceposts
+		insert_fenceposts(mem, size);
+		header * block = get_header_from_offset(mem, ALLOC_HEADER_SIZE);
+		set_block_size_and_state(block, size - 2 * ALLOC_HEADER_SIZE, UNALLOCATED);
+		set_left_size(block, ALLOC_HEADER_SIZE);
+		insert_os_chunk((header *) mem);
+		lastFencePost = get_header_from_offset(block, get_block_size(block));
+		insert_free_block(&heapLists, block);
+		return true;
 }
 /**
  * @brief Helper to get the header from a pointer allocated with malloc
@@ -464,167 +924,42 @@ static inline void deallocate_object(void * p) {
 				return; 
 		}
 		// Terminating if double free
-		header *block_ptr = get_header_from_offset(p, -ALLOC_HEADER_SIZE);
+		header *block_ptr = ptr_to_header(p);
 		if (get_block_state(block_ptr) == UNALLOCATED) {
 				printf("Double Free Detected\n");
 				assert(0);
 		}
+		account_free(block_ptr);
 		set_block_state(block_ptr, UNALLOCATED);  
-		header *left_block = block_ptr;
-		header *right_block = block_ptr;
-		left_block =  get_header_from_offset(block_ptr, -(block_ptr->left_size));
-		right_block = get_header_from_offset(block_ptr, get_block_size(block_ptr));
-		// Covering case of freeing middle block in |F||A||F| or |F||A||A| or |A||A||F| or |A||A||A|
-		if ((get_block_state(left_block) == ALLOCATED && get_block_state(right_block) == ALLOCATED ) || (get_block_state(left_block) == FENCEPOST && get_block_state(right_block) == ALLOCATED) || (get_block_state(left_block) == ALLOCATED && get_block_state(right_block) == FENCEPOST) || (get_block_state(left_block) == FENCEPOST && get_block_state(right_block) == FENCEPOST)) {
-				size_t size = get_block_size(block_ptr);
-				size -= ALLOC_HEADER_SIZE;
-				size /= 8;
-				size--;
-				header *head_ptr;
-				if (size < N_LISTS - 1) {
-						head_ptr = &freelistSentinels[size];
-				}
-				else {
-						head_ptr = &freelistSentinels[N_LISTS - 1];
-				}
-				header *next_ptr = block_ptr->next;
-				if (head_ptr->next == head_ptr && head_ptr->prev == head_ptr) {
-						head_ptr->next = block_ptr;  
-						head_ptr->prev = block_ptr;  
-						block_ptr->prev = head_ptr;  
-						block_ptr->next = head_ptr;  
-				}
-				else {
-						block_ptr->next = head_ptr->next;
-						block_ptr->prev = head_ptr;
-						head_ptr->next->prev = block_ptr;
-						head_ptr->next = block_ptr;
-				}
-				set_block_state(block_ptr, UNALLOCATED);
-		}
-		// Covering case of freeing middle block in |U||A||A| or |U||A||F|
-		else if ((get_block_state(left_block) == UNALLOCATED && get_block_state(right_block) == ALLOCATED) || (get_block_state(left_block) == UNALLOCATED && get_block_state(right_block) == FENCEPOST)){
-				header *head_ptr;
-				size_t size = get_block_size(block_ptr);
-				size_t left_size = block_ptr->left_size;
-				size += left_size;
-				right_block->left_size = size;
-				set_block_size(left_block, size);
-				size -= ALLOC_HEADER_SIZE;
-				size /= 8;
-				size--;
-				if (size < N_LISTS - 1) {
-						if (left_block->next != left_block->prev) {
-								left_block->next->prev = left_block->prev;
-								left_block->prev->next = left_block->next;
-						}
-						else {
-								left_block->prev->prev = left_block->prev;
-								left_block->prev->next = left_block->prev;
-						}
-						head_ptr = &freelistSentinels[size];
-						if (head_ptr->prev == head_ptr) {
-								head_ptr->next = left_block;
-								head_ptr->prev = left_block;
-								left_block->prev = head_ptr;
-								left_block->next = head_ptr;
-						}
-						else {
-								left_block->next = head_ptr->next;
-								head_ptr->next = left_block;
-								left_block->next->prev = left_block;
-								left_block->prev = head_ptr;
-						}
-				}
-		} 
-		// Covering case of freeing middle block in |A||A||U| or |F||A||U|
-		else if ((get_block_state(left_block) == ALLOCATED && get_block_state(right_block) == UNALLOCATED) || (get_block_state(left_block) == FENCEPOST && get_block_state(right_block) == UNALLOCATED)) {
-				header *head_ptr;
-				size_t size = get_block_size(block_ptr);
-				size_t right_size = get_block_size(right_block);
-				size += right_size;
-				set_block_state(block_ptr, UNALLOCATED);
-				set_block_size(block_ptr, size);
-				header *right_to_right = (header*) ((char *) right_block + right_size);
-				right_to_right->left_size = size;
-				size -= ALLOC_HEADER_SIZE;
-				size /= 8;
-				size--;
-				if (size < N_LISTS - 1) {
-						if (right_block->next != right_block->prev) {
-								right_block->prev->next = right_block->next;
-								right_block->next->prev = right_block->prev;
-						}
-						else {
-								right_block->prev->prev = right_block->prev;
-								right_block->prev->next = right_block->prev;
-						}
-						head_ptr = &freelistSentinels[size];
-						if (head_ptr->prev == head_ptr) {
-								head_ptr->next = block_ptr;
-								head_ptr->prev = block_ptr;
-								block_ptr->prev = head_ptr;
-								block_ptr->next = head_ptr;
-						}
-						else {
-								block_ptr->next = head_ptr->next;
-								head_ptr->next = block_ptr;
-								block_ptr->next->prev = block_ptr;
-								block_ptr->prev = head_ptr;
-						}
-				}
-				else {
-						head_ptr = &freelistSentinels[N_LISTS - 1];
-						right_block->prev->next = block_ptr;
-						block_ptr->next = right_block->next;
-						block_ptr->prev = right_block->prev;
-						block_ptr->next->prev = block_ptr;
-				}
-		}
-		// Covering case of freeing middle block in |U||A||U|
-		else if ((get_block_state(left_block) == UNALLOCATED && get_block_state(right_block) == UNALLOCATED)) {
-				header *head_ptr;
-				size_t size = get_block_size(left_block);
-				size += get_block_size(block_ptr);
-				size += get_block_size(right_block);
-				set_block_size(left_block, size);
-				header *right_to_right = get_header_from_offset(right_block, get_block_size(right_block));
-				right_to_right->left_size = size;
-				size -= ALLOC_HEADER_SIZE;
-				size /= 8;
-				size--;
-				if (right_block->next != right_block->prev) {
-						right_block->next->prev = right_block->prev;
-						right_block->prev->next = right_block->next;
-				}
-				else {
-						right_block->prev->prev = right_block->prev;
-						right_block->prev->next = right_block->prev;
-				}
-				if (size < N_LISTS - 1){
-						if (left_block->next != left_block->prev) {
-								left_block->next->prev = left_block->prev;
-								left_block->prev->next = left_block->next;
-						}
-						else {
-								left_block->prev->prev = left_block->prev;
-								left_block->prev->next = left_block->prev;
-						}
-						head_ptr = &freelistSentinels[size];
-						if (head_ptr->prev == head_ptr) {
-								head_ptr->next = left_block;
-								head_ptr->prev = left_block;
-								left_block->prev = head_ptr;
-								left_block->next = head_ptr;
-						}
-						else {
-								left_block->next = head_ptr->next;
-								head_ptr->next = left_block;
-								left_block->next->prev = left_block;
-								left_block->prev = head_ptr;
-						}
-				}
+		coalesce_free_block(&heapLists, block_ptr);
+}
+
+/**
+ * @brief Helper to give the tail of an allocated block back to the heap when
+ *        it shrinks, if the tail is large enough to be a free block. The
+ *        caller must hold the heap mutex
+ *
+ * @param p The pointer returned to the user by a call to malloc
+ * @param raw_size number of bytes the user still needs
+ */
+static void shrink_object(void * p, size_t raw_size) {
+		header *block_ptr = ptr_to_header(p);
+		if (raw_size < ALLOC_HEADER_SIZE) {
+				raw_size = ALLOC_HEADER_SIZE;
+		}
+		size_t actual_size = (raw_size + ALLOC_HEADER_SIZE + 7) & ~(size_t) 7;
+		size_t diff = get_block_size(block_ptr) - actual_size;
+		if (diff < 2 * ALLOC_HEADER_SIZE) {
+				return;
 		}
+		unsigned tag = get_block_tag(block_ptr);
+		account_free(block_ptr);
+		set_block_size(block_ptr, actual_size);
+		header * tail = get_header_from_offset(block_ptr, actual_size);
+		set_block_size_and_state(tail, diff, UNALLOCATED);
+		set_left_size(tail, actual_size);
+		coalesce_free_block(&heapLists, tail);
+		account_allocation(p, tag);
 }
 
 /**
@@ -636,9 +971,9 @@ static inline void deallocate_object(void * p) {
 static inline header * detect_cycles() {
 		for (int i = 0; i < N_LISTS; i++) {
 				header * freelist = &freelistSentinels[i];
-				for (header * slow = freelist->next, * fast = freelist->next->next; 
+				for (header * slow = get_next(freelist), * fast = get_next(get_next(freelist)); 
 								fast != freelist; 
-								slow = slow->next, fast = fast->next->next) {
+								slow = get_next(slow), fast = get_next(get_next(fast))) {
 						if (slow == fast) {
 								return slow;
 						}
@@ -657,8 +992,8 @@ static inline header * detect_cycles() {
 static inline header * verify_pointers() {
 		for (int i = 0; i < N_LISTS; i++) {
 				header * freelist = &freelistSentinels[i];
-				for (header * cur = freelist->next; cur != freelist; cur = cur->next) {
-						if (cur->next->prev != cur || cur->prev->next != cur) {
+				for (header * cur = get_next(freelist); cur != freelist; cur = get_next(cur)) {
+						if (get_prev(get_next(cur)) != cur || get_next(get_prev(cur)) != cur) {
 								return cur;
 						}
 				}
@@ -676,7 +1011,7 @@ static inline bool verify_freelist() {
 		header * cycle = detect_cycles();
 		if (cycle != NULL) {
 				fprintf(stderr, "Cycle Detected\n");
-				print_sublist(print_object, cycle->next, cycle);
+				print_sublist(print_object, get_next(cycle), cycle);
 				return false;
 		}
 
@@ -706,7 +1041,7 @@ static inline header * verify_chunk(header * chunk) {
 		}
 
 		for (; get_block_state(chunk) != FENCEPOST; chunk = get_right_header(chunk)) {
-				if (get_block_size(chunk)  != get_right_header(chunk)->left_size) {
+				if (get_block_size(chunk)  != get_left_size(get_right_header(chunk))) {
 						fprintf(stderr, "Invalid sizes\n");
 						print_object(chunk);
 						return chunk;
@@ -723,8 +1058,8 @@ static inline header * verify_chunk(header * chunk) {
  * @return true if the boundary tags are valid
  */
 static inline bool verify_tags() {
-		for (size_t i = 0; i < numOsChunks; i++) {
-				header * invalid = verify_chunk(osChunkList[i]);
+		for (size_t i = 0; i < get_num_os_chunks(); i++) {
+				header * invalid = verify_chunk(get_os_chunk(i));
 				if (invalid != NULL) {
 						return invalid;
 				}
@@ -734,11 +1069,15 @@ static inline bool verify_tags() {
 }
 
 /**
- * @brief Initialize mutex lock and prepare an initial chunk of memory for allocation
+ * @brief Prepare an initial chunk of memory for allocation. Called by the
+ *        first allocation with the mutex held
+ *
+ * @return false if the OS refused the first chunk, the heap then stays
+ *         uninitialized and the next allocation tries again
  */
-static void init() {
-		// Initialize mutex for thread safety
-		pthread_mutex_init(&mutex, NULL);
+static bool init() {
+		load_config();
+		heapGrowth = arenaSize;
 
 #ifdef DEBUG
 		// Manually set printf buffer so it won't call malloc when debugging the allocator
@@ -746,7 +1085,12 @@ static void init() {
 #endif // DEBUG
 
 		// Allocate the first chunk from the OS
-		header * block = allocate_chunk(ARENA_SIZE);
+		header * block = allocate_chunk(arenaSize);
+		if (block == NULL) {
+				errno = ENOMEM;
+				return false;
+		}
+		isMallocInitialized = true;
 
 		header * prevFencePost = get_header_from_offset(block, -ALLOC_HEADER_SIZE);
 		insert_os_chunk(prevFencePost);
@@ -757,48 +1101,1327 @@ static void init() {
 		// chunk from the OS
 		base = ((char *) block) - ALLOC_HEADER_SIZE; //sizeof(header);
 
+		heapLists.num_lists = numLists;
+		heapLists.link_base = HEAP_LINK_BASE;
+
 		// Initialize freelist sentinels
 		for (int i = 0; i < N_LISTS; i++) {
 				header * freelist = &freelistSentinels[i];
-				freelist->next = freelist;
-				freelist->prev = freelist;
+				set_next(freelist, freelist);
+				set_prev(freelist, freelist);
 		}
 
 		// Insert first chunk into the free list
-		header * freelist = &freelistSentinels[N_LISTS - 1];
-		freelist->next = block;
-		freelist->prev = block;
-		block->next = freelist;
-		block->prev = freelist;
+		header * freelist = &freelistSentinels[numLists - 1];
+		set_next(freelist, block);
+		set_prev(freelist, block);
+		set_next(block, freelist);
+		set_prev(block, freelist);
+		return true;
 }
 
-/* 
- * External interface
+#ifdef PERF_COUNTERS
+/**
+ * @brief Helper to open one counter of a thread's group
+ *
+ * @param type perf event type
+ * @param config perf event config for the type
+ * @param group_fd the group leader or -1 to open a new group
+ *
+ * @return the counter file descriptor or -1 if it is not available
  */
-void * my_malloc(size_t size) {
-		pthread_mutex_lock(&mutex);
-		header * hdr = allocate_object(size); 
-		pthread_mutex_unlock(&mutex);
-		return hdr;
+static int perf_open(uint32_t type, uint64_t config, int group_fd) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.exclude_hv = 1;
+		int fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+		if (fd < 0 && errno == EACCES) {
+				// Unprivileged processes may only count user space
+				attr.exclude_kernel = 1;
+				fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+		}
+		return fd;
 }
 
-void * my_calloc(size_t nmemb, size_t size) {
-		return memset(my_malloc(size * nmemb), 0, size * nmemb);
+/**
+ * @brief Helper to get the calling thread's counter record, opening its
+ *        counter group on first use
+ *
+ * @return the record or NULL if no counters could be opened
+ */
+static perf_thread * perf_thread_get() {
+		if (perfThread != NULL) {
+				return perfThread->group_fd >= 0 ? perfThread : NULL;
+		}
+		perf_thread * t = __atomic_load_n(&perfThreads, __ATOMIC_ACQUIRE);
+		for (; t != NULL; t = t->next) {
+				bool owned = false;
+				if (__atomic_compare_exchange_n(&t->owned, &owned, true, false,
+										__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+						break;
+				}
+		}
+		if (t == NULL) {
+				t = mmap(NULL, sizeof(perf_thread), PROT_READ | PROT_WRITE,
+								MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (t == MAP_FAILED) {
+						return NULL;
+				}
+				t->owned = true;
+				// Publish the record so my_perf_dump can find it from any thread
+				t->next = __atomic_load_n(&perfThreads, __ATOMIC_RELAXED);
+				while (!__atomic_compare_exchange_n(&perfThreads, &t->next, t, true,
+										__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+				}
+		}
+		static const uint32_t types[N_PERF_COUNTERS] = {
+				PERF_TYPE_SOFTWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+				PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE,
+		};
+		static const uint64_t configs[N_PERF_COUNTERS] = {
+				PERF_COUNT_SW_PAGE_FAULTS,
+				PERF_COUNT_HW_CPU_CYCLES,
+				PERF_COUNT_HW_INSTRUCTIONS,
+				PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+						(PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+				PERF_COUNT_HW_CACHE_MISSES,
+		};
+		// The software page fault counter leads the group as it is available
+		// even where the PMU is not (e.g. most virtual machines)
+		t->tid = syscall(SYS_gettid);
+		t->group_fd = -1;
+		t->num_slots = 0;
+		for (int i = 0; i < N_PERF_COUNTERS; i++) {
+				int fd = perf_open(types[i], configs[i], t->group_fd);
+				t->fds[i] = fd;
+				if (fd < 0) {
+						t->slot[i] = -1;
+						continue;
+				}
+				if (t->group_fd < 0) {
+						t->group_fd = fd;
+				}
+				t->slot[i] = t->num_slots++;
+		}
+		perfThread = t;
+		// Close the counters and give the record back when the thread exits
+		pthread_once(&perfKeyOnce, create_perf_key);
+		pthread_setspecific(perfKey, t);
+		if (t->group_fd < 0) {
+				return NULL;
+		}
+		ioctl(t->group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		return t;
 }
 
-void * my_realloc(void * ptr, size_t size) {
-		void * mem = my_malloc(size);
-		memcpy(mem, ptr, size);
+/**
+ * @brief Create the key whose destructor releases counter records
+ */
+static void create_perf_key() {
+		pthread_key_create(&perfKey, release_perf_thread);
+}
+
+/**
+ * @brief Thread exit destructor that closes the thread's counters, adds its
+ *        totals to those of the exited threads and releases its record for
+ *        reuse
+ *
+ * @param arg the exiting thread's record
+ */
+static void release_perf_thread(void * arg) {
+		perf_thread * t = arg;
+		for (int i = 0; i < N_PERF_COUNTERS; i++) {
+				if (t->fds[i] >= 0) {
+						close(t->fds[i]);
+						__atomic_store_n(&perfExitedCounters[i], true, __ATOMIC_RELAXED);
+				}
+		}
+		for (int site = 0; site < N_PERF_SITES; site++) {
+				for (int bin = 0; bin < N_LISTS; bin++) {
+						perf_totals * totals = &t->totals[site][bin];
+						perf_totals * exited = &perfExitedTotals[site][bin];
+						__atomic_add_fetch(&exited->calls, totals->calls, __ATOMIC_RELAXED);
+						for (int i = 0; i < N_PERF_COUNTERS; i++) {
+								__atomic_add_fetch(&exited->counters[i], totals->counters[i], __ATOMIC_RELAXED);
+						}
+				}
+		}
+		memset(t->totals, 0, sizeof(t->totals));
+		t->group_fd = -1;
+		perfThread = NULL;
+		__atomic_store_n(&t->owned, false, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Helper to read the current value of every counter of a thread
+ *
+ * @param t the thread's counter record
+ * @param values array of N_PERF_COUNTERS + 1 entries, the first holding the
+ *        number of counters in the group
+ *
+ * @return true if the counters were read
+ */
+static inline bool perf_read(perf_thread * t, uint64_t * values) {
+		ssize_t len = (t->num_slots + 1) * sizeof(uint64_t);
+		return read(t->group_fd, values, len) == len;
+}
+
+/**
+ * @brief Start measuring an instrumented site
+ *
+ * @param start array of N_PERF_COUNTERS + 1 entries to store the counters in
+ */
+static inline void perf_begin(uint64_t * start) {
+		perf_thread * t = perf_thread_get();
+		if (t == NULL || !perf_read(t, start)) {
+				start[0] = 0;
+		}
+}
+
+/**
+ * @brief Finish measuring an instrumented site and add the deltas to the
+ *        calling thread's totals
+ *
+ * @param site the instrumented site
+ * @param bin the freelist the request maps to
+ * @param start the counters read by perf_begin
+ */
+static inline void perf_end(enum perf_site site, size_t bin, uint64_t * start) {
+		uint64_t end[N_PERF_COUNTERS + 1];
+		perf_thread * t = perfThread;
+		if (start[0] == 0 || !perf_read(t, end)) {
+				return;
+		}
+		perf_totals * totals = &t->totals[site][bin < N_LISTS - 1 ? bin : N_LISTS - 1];
+		totals->calls++;
+		for (int i = 0; i < N_PERF_COUNTERS; i++) {
+				if (t->slot[i] >= 0) {
+						totals->counters[i] += end[t->slot[i] + 1] - start[t->slot[i] + 1];
+				}
+		}
+}
+
+/**
+ * @brief Helper to find the freelist a request of a given size starts its
+ *        search in
+ *
+ * @param raw_size number of bytes the user asked for
+ *
+ * @return index of the freelist
+ */
+static inline size_t perf_request_bin(size_t raw_size) {
+		if (raw_size < ALLOC_HEADER_SIZE) {
+				raw_size = ALLOC_HEADER_SIZE;
+		}
+		size_t actual_size = (raw_size + ALLOC_HEADER_SIZE + 7) & ~(size_t) 7;
+		return (actual_size - ALLOC_HEADER_SIZE) / 8 - 1;
+}
+
+/**
+ * @brief Helper to find the freelist a block of a given size belongs to
+ *
+ * @param p pointer returned to the user or NULL
+ *
+ * @return index of the freelist
+ */
+static inline size_t perf_block_bin(void * p) {
+		if (p == NULL) {
+				return 0;
+		}
+		return (get_block_size(ptr_to_header(p)) - ALLOC_HEADER_SIZE) / 8 - 1;
+}
+
+/**
+ * @brief Helper to write one line of my_perf_dump
+ *
+ * @param fd file descriptor to write to
+ * @param tid thread the totals belong to
+ * @param site the instrumented site
+ * @param bin the freelist bin
+ * @param totals the totals to write, skipped if never called
+ * @param slot position of each counter or -1 if it was not available
+ */
+static void perf_dump_totals(int fd, const char * tid, int site, int bin, perf_totals * totals,
+				const int * slot) {
+		uint64_t calls = __atomic_load_n(&totals->calls, __ATOMIC_RELAXED);
+		if (calls == 0) {
+				return;
+		}
+		dprintf(fd, "%s %s %d %lu", tid, perfSiteNames[site], bin, (unsigned long) calls);
+		for (int i = 0; i < N_PERF_COUNTERS; i++) {
+				if (slot[i] < 0) {
+						dprintf(fd, " -");
+				} else {
+						dprintf(fd, " %lu", (unsigned long) __atomic_load_n(&totals->counters[i], __ATOMIC_RELAXED));
+				}
+		}
+		dprintf(fd, "\n");
+}
+#endif // PERF_COUNTERS
+
+void my_perf_dump(int fd) {
+#ifdef PERF_COUNTERS
+		static const char * const counterNames[N_PERF_COUNTERS] = {
+				"page_faults", "cycles", "instructions", "l1d_misses", "llc_misses",
+		};
+		dprintf(fd, "tid site bin calls");
+		for (int i = 0; i < N_PERF_COUNTERS; i++) {
+				dprintf(fd, " %s", counterNames[i]);
+		}
+		dprintf(fd, "\n");
+		perf_thread * t = __atomic_load_n(&perfThreads, __ATOMIC_ACQUIRE);
+		for (; t != NULL; t = t->next) {
+				if (!__atomic_load_n(&t->owned, __ATOMIC_ACQUIRE)) {
+						continue;
+				}
+				char tid[16];
+				snprintf(tid, sizeof(tid), "%d", (int) t->tid);
+				for (int site = 0; site < N_PERF_SITES; site++) {
+						for (int bin = 0; bin < N_LISTS; bin++) {
+								perf_dump_totals(fd, tid, site, bin, &t->totals[site][bin], t->slot);
+						}
+				}
+		}
+		// Threads that have exited are reported together
+		int exited_slot[N_PERF_COUNTERS];
+		for (int i = 0; i < N_PERF_COUNTERS; i++) {
+				exited_slot[i] = __atomic_load_n(&perfExitedCounters[i], __ATOMIC_RELAXED) ? i : -1;
+		}
+		for (int site = 0; site < N_PERF_SITES; site++) {
+				for (int bin = 0; bin < N_LISTS; bin++) {
+						perf_dump_totals(fd, "exited", site, bin, &perfExitedTotals[site][bin], exited_slot);
+				}
+		}
+#else
+		(void) fd;
+#endif // PERF_COUNTERS
+}
+
+/*
+ * Heap walk interface
+ */
+
+/**
+ * @brief Helper to collect the next blocks of a chunk from the OS, starting
+ *        at the walk cursor and leaving it after the last one collected. The
+ *        caller must hold the heap mutex
+ *
+ * @param index index of the chunk in the chunk list
+ * @param batch array of WALK_BATCH entries to fill
+ *
+ * @return number of blocks collected, less than WALK_BATCH at the end of the
+ *         chunk
+ */
+static size_t walk_batch(size_t index, my_heap_block * batch) {
+		header * block = heapLists.walk_cursor;
+		size_t n = 0;
+		for (; n < WALK_BATCH && get_block_state(block) != FENCEPOST; block = get_right_header(block)) {
+				batch[n].addr = block;
+				batch[n].size = get_block_size(block);
+				batch[n].state = get_block_state(block);
+				batch[n].chunk = index;
+				n++;
+		}
+		heapLists.walk_cursor = block;
+		return n;
+}
+
+void my_heap_walk(my_heap_walk_fn callback, void * ctx) {
+		my_heap_block batch[WALK_BATCH];
+		bool keep_going = true;
+		pthread_mutex_lock(&walkMutex);
+		for (size_t i = 0; keep_going; i++) {
+				size_t n = WALK_BATCH;
+				for (bool first = true; keep_going && n == WALK_BATCH; first = false) {
+						pthread_mutex_lock(&mutex);
+						if (first) {
+								if (i >= get_num_os_chunks()) {
+										pthread_mutex_unlock(&mutex);
+										keep_going = false;
+										break;
+								}
+								heapLists.walk_cursor = get_right_header(get_os_chunk(i));
+						}
+						n = walk_batch(i, batch);
+						pthread_mutex_unlock(&mutex);
+						// Callbacks run unlocked so the heap is only held up for one batch
+						for (size_t j = 0; keep_going && j < n; j++) {
+								keep_going = callback(&batch[j], ctx);
+						}
+				}
+		}
+		pthread_mutex_lock(&mutex);
+		heapLists.walk_cursor = NULL;
+		pthread_mutex_unlock(&mutex);
+		pthread_mutex_unlock(&walkMutex);
+}
+
+/**
+ * @brief Helper to add text to a heap dump, writing out what was buffered
+ *        first if it does not fit
+ *
+ * @param run the dump in progress
+ * @param fmt printf format of the text
+ */
+static void heap_dump_append(heap_dump_run * run, const char * fmt, ...) {
+		for (int attempt = 0; attempt < 2; attempt++) {
+				va_list args;
+				va_start(args, fmt);
+				size_t room = sizeof(run->text) - run->len;
+				int len = vsnprintf(run->text + run->len, room, fmt, args);
+				va_end(args);
+				if (len >= 0 && (size_t) len < room) {
+						run->len += len;
+						return;
+				}
+				heap_dump_write(run);
+		}
+}
+
+/**
+ * @brief Helper to write out the buffered text of a heap dump
+ *
+ * @param run the dump in progress
+ */
+static void heap_dump_write(heap_dump_run * run) {
+		for (size_t done = 0; done < run->len; ) {
+				ssize_t written = write(run->fd, run->text + done, run->len - done);
+				if (written <= 0) {
+						break;
+				}
+				done += written;
+		}
+		run->len = 0;
+}
+
+/**
+ * @brief Helper to add the current run of a heap dump to its text
+ *
+ * @param run the run to add, reset afterwards
+ */
+static void heap_dump_flush(heap_dump_run * run) {
+		static const char stateNames[] = { 'U', 'A', 'F' };
+		if (run->blocks != 0) {
+				heap_dump_append(run, " %c%zu/%zu", stateNames[run->state], run->bytes, run->blocks);
+		}
+		run->bytes = 0;
+		run->blocks = 0;
+}
+
+/**
+ * @brief my_heap_walk callback extending or starting a run of blocks, and
+ *        starting a new line when the walk enters the next chunk
+ *
+ * @param block the block being visited
+ * @param ctx the heap_dump_run of the dump
+ *
+ * @return true to continue the walk
+ */
+static bool heap_dump_block(const my_heap_block * block, void * ctx) {
+		heap_dump_run * run = ctx;
+		if (run->chunk != block->chunk) {
+				heap_dump_flush(run);
+				if (run->chunk != SIZE_MAX) {
+						heap_dump_append(run, "\n");
+				}
+				// The first block of a chunk follows its left fencepost
+				run->chunk = block->chunk;
+				heap_dump_append(run, "chunk %zu %td:", block->chunk,
+								(char *) block->addr - ALLOC_HEADER_SIZE - (char *) base);
+		}
+		else if (run->blocks != 0 && run->state != block->state) {
+				heap_dump_flush(run);
+		}
+		run->state = block->state;
+		run->bytes += block->size;
+		run->blocks++;
+		return true;
+}
+
+void my_heap_dump(int fd) {
+		heap_dump_run run;
+		run.fd = fd;
+		run.chunk = SIZE_MAX;
+		run.bytes = 0;
+		run.blocks = 0;
+		run.len = 0;
+		my_heap_walk(heap_dump_block, &run);
+		heap_dump_flush(&run);
+		if (run.chunk != SIZE_MAX) {
+				heap_dump_append(&run, "\n");
+		}
+		heap_dump_write(&run);
+}
+
+/*
+ * Deferred free interface
+ */
+
+/**
+ * @brief Helper to get the calling thread's deferred free buffer, adopting
+ *        the buffer of an exited thread or mapping a new one on first use
+ *
+ * @return the buffer or NULL if none could be mapped
+ */
+static deferred_buffer * deferred_buffer_get() {
+		if (deferredBuffer != NULL) {
+				return deferredBuffer;
+		}
+		deferred_buffer * b = __atomic_load_n(&deferredBuffers, __ATOMIC_ACQUIRE);
+		for (; b != NULL; b = b->next) {
+				bool owned = false;
+				if (__atomic_compare_exchange_n(&b->owned, &owned, true, false,
+										__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+						break;
+				}
+		}
+		if (b == NULL) {
+				b = mmap(NULL, sizeof(deferred_buffer), PROT_READ | PROT_WRITE,
+								MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (b == MAP_FAILED) {
+						return NULL;
+				}
+				b->owned = true;
+				b->next = __atomic_load_n(&deferredBuffers, __ATOMIC_RELAXED);
+				while (!__atomic_compare_exchange_n(&deferredBuffers, &b->next, b, true,
+										__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+				}
+		}
+		deferredBuffer = b;
+		// Make sure the buffer is drained and released when the thread exits
+		pthread_once(&deferredKeyOnce, create_deferred_key);
+		pthread_setspecific(deferredKey, b);
+		return b;
+}
+
+/**
+ * @brief Create the key whose destructor drains deferred free buffers
+ */
+static void create_deferred_key() {
+		pthread_key_create(&deferredKey, release_deferred_buffer);
+}
+
+/**
+ * @brief qsort comparator ordering pointers by address
+ */
+static int compare_pointers(const void * a, const void * b) {
+		uintptr_t x = (uintptr_t) *(void * const *) a;
+		uintptr_t y = (uintptr_t) *(void * const *) b;
+		return (x > y) - (x < y);
+}
+
+/**
+ * @brief Helper to free every pointer queued in a buffer in address order.
+ *        The caller must hold the heap mutex
+ *
+ * @param b the buffer to drain
+ */
+static void drain_deferred(deferred_buffer * b) {
+		void * batch[DEFERRED_FREE_CAPACITY];
+		size_t head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+		size_t n = head - b->tail;
+		if (n == 0) {
+				return;
+		}
+		for (size_t i = 0; i < n; i++) {
+				batch[i] = b->ptrs[(b->tail + i) % DEFERRED_FREE_CAPACITY];
+		}
+		__atomic_store_n(&b->tail, head, __ATOMIC_RELEASE);
+		// Freeing neighbours one after another keeps the coalescing local
+		qsort(batch, n, sizeof(void *), compare_pointers);
+		for (size_t i = 0; i < n; i++) {
+				deallocate_object(batch[i]);
+		}
+}
+
+/**
+ * @brief Thread exit destructor that frees what the thread left queued and
+ *        releases its buffer for reuse
+ *
+ * @param arg the exiting thread's buffer
+ */
+static void release_deferred_buffer(void * arg) {
+		deferred_buffer * b = arg;
+		pthread_mutex_lock(&mutex);
+		drain_deferred(b);
+		pthread_mutex_unlock(&mutex);
+		deferredBuffer = NULL;
+		__atomic_store_n(&b->owned, false, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Body of the background reclaimer thread
+ *
+ * @param arg unused
+ *
+ * @return NULL
+ */
+static void * reclaimer_main(void * arg) {
+		(void) arg;
+		struct timespec interval = {
+				.tv_sec = reclaimerInterval / 1000000,
+				.tv_nsec = (reclaimerInterval % 1000000) * 1000,
+		};
+		while (__atomic_load_n(&reclaimerRunning, __ATOMIC_ACQUIRE)) {
+				my_free_deferred_flush_all();
+				nanosleep(&interval, NULL);
+		}
+		return NULL;
+}
+
+void my_free_deferred(void * p) {
+		if (p == NULL) {
+				return;
+		}
+		deferred_buffer * b = deferred_buffer_get();
+		if (b == NULL) {
+				my_free(p);
+				return;
+		}
+		// The buffer is bounded, when it is full drain it synchronously
+		if (b->head - __atomic_load_n(&b->tail, __ATOMIC_ACQUIRE) >= deferredBatch) {
+				my_free_deferred_flush();
+		}
+		b->ptrs[b->head % DEFERRED_FREE_CAPACITY] = p;
+		__atomic_store_n(&b->head, b->head + 1, __ATOMIC_RELEASE);
+}
+
+void my_free_deferred_flush() {
+		if (deferredBuffer == NULL) {
+				return;
+		}
+		pthread_mutex_lock(&mutex);
+		drain_deferred(deferredBuffer);
+		pthread_mutex_unlock(&mutex);
+}
+
+void my_free_deferred_flush_all() {
+		pthread_mutex_lock(&mutex);
+		deferred_buffer * b = __atomic_load_n(&deferredBuffers, __ATOMIC_ACQUIRE);
+		for (; b != NULL; b = b->next) {
+				drain_deferred(b);
+		}
+		pthread_mutex_unlock(&mutex);
+}
+
+bool my_start_reclaimer(unsigned interval_us) {
+		if (reclaimerRunning) {
+				return false;
+		}
+		reclaimerInterval = interval_us < MIN_RECLAIMER_INTERVAL ? MIN_RECLAIMER_INTERVAL : interval_us;
+		__atomic_store_n(&reclaimerRunning, true, __ATOMIC_RELEASE);
+		if (pthread_create(&reclaimerThread, NULL, reclaimer_main, NULL) != 0) {
+				reclaimerRunning = false;
+				return false;
+		}
+		return true;
+}
+
+void my_stop_reclaimer() {
+		if (!reclaimerRunning) {
+				return;
+		}
+		__atomic_store_n(&reclaimerRunning, false, __ATOMIC_RELEASE);
+		pthread_join(reclaimerThread, NULL);
+		my_free_deferred_flush_all();
+}
+
+/*
+ * Runtime configuration interface
+ */
+
+/**
+ * @brief Helper to validate and apply one tunable
+ *
+ * @param param one of the MEMALC_* parameters from MeMALC.h
+ * @param value the new value
+ *
+ * @return true if the value was applied
+ */
+static bool set_tunable(int param, size_t value) {
+		switch (param) {
+		case MEMALC_ARENA_SIZE:
+				// The first chunk needs room for two fenceposts and a block, and
+				// has to be describable by the header layout
+				if (value % 8 != 0 || value < 2 * ALLOC_HEADER_SIZE + sizeof(header)
+								|| value > MAX_BLOCK_SIZE) {
+						return false;
+				}
+				arenaSize = value;
+				return true;
+		case MEMALC_MAX_GROWTH:
+				if (value == 0) {
+						return false;
+				}
+				maxHeapGrowth = value;
+				return true;
+		case MEMALC_N_LISTS:
+				// The freelists can only be laid out before the heap exists
+				if (value < 1 || value > N_LISTS || isMallocInitialized) {
+						return false;
+				}
+				numLists = value;
+				return true;
+		case MEMALC_DEFERRED_BATCH:
+				if (value < 1 || value > DEFERRED_FREE_CAPACITY) {
+						return false;
+				}
+				deferredBatch = value;
+				return true;
+		default:
+				return false;
+		}
+}
+
+/**
+ * @brief Helper to read the MEMALC_CONF environment variable once. It holds
+ *        comma separated name:value pairs, e.g. "arena_size:65536,n_lists:32".
+ *        Unknown names and invalid values are ignored
+ */
+static void load_config() {
+		static const struct {
+				const char * name;
+				int param;
+		} names[] = {
+				{ "arena_size", MEMALC_ARENA_SIZE },
+				{ "max_growth", MEMALC_MAX_GROWTH },
+				{ "n_lists", MEMALC_N_LISTS },
+				{ "deferred_batch", MEMALC_DEFERRED_BATCH },
+		};
+		if (isConfigLoaded) {
+				return;
+		}
+		isConfigLoaded = true;
+		const char * conf = getenv("MEMALC_CONF");
+		while (conf != NULL && *conf != '\0') {
+				const char * colon = strchr(conf, ':');
+				if (colon == NULL) {
+						return;
+				}
+				char * end;
+				size_t value = strtoul(colon + 1, &end, 0);
+				for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+						if (strlen(names[i].name) == (size_t) (colon - conf) &&
+										strncmp(conf, names[i].name, colon - conf) == 0) {
+								set_tunable(names[i].param, value);
+						}
+				}
+				conf = strchr(end, ',');
+				if (conf != NULL) {
+						conf++;
+				}
+		}
+}
+
+int my_mallopt(int param, size_t value) {
+		pthread_mutex_lock(&mutex);
+		load_config();
+		bool applied = set_tunable(param, value);
+		pthread_mutex_unlock(&mutex);
+		return applied;
+}
+
+/*
+ * Shared memory heap interface
+ */
+
+/**
+ * @brief Helper to get the freelists of a shared heap, whose links are
+ *        relative to the start of the mapping
+ *
+ * @param heap the shared heap
+ *
+ * @return the set of freelists
+ */
+static inline freelist_set shm_lists(my_shm_heap * heap) {
+		freelist_set lists = { heap->sentinels, N_LISTS, (char *) heap, NULL };
+		return lists;
+}
+
+/**
+ * @brief Helper to check that a shared heap whose lock owner died is intact:
+ *        the boundary tags tile the chunk and every freelist entry is a free
+ *        block of the right size class with consistent links
+ *
+ * @param heap the shared heap, locked
+ *
+ * @return true if the heap can be used again
+ */
+static bool shm_verify(my_shm_heap * heap) {
+		char * end = (char *) heap + heap->size;
+		header * block = (header *) heap->chunk;
+		size_t free_blocks = 0;
+		if (get_block_state(block) != FENCEPOST) {
+				return false;
+		}
+		for (block = get_right_header(block); get_block_state(block) != FENCEPOST; block = get_right_header(block)) {
+				size_t size = get_block_size(block);
+				if (size < 2 * ALLOC_HEADER_SIZE || size % 8 != 0 ||
+								size > (size_t) (end - (char *) block) - ALLOC_HEADER_SIZE ||
+								get_left_size(get_right_header(block)) != size) {
+						return false;
+				}
+				free_blocks += get_block_state(block) == UNALLOCATED;
+		}
+		if ((char *) block != end - ALLOC_HEADER_SIZE) {
+				return false;
+		}
+		freelist_set lists = shm_lists(heap);
+		size_t listed = 0;
+		for (size_t i = 0; i < lists.num_lists; i++) {
+				header * freelist = &lists.sentinels[i];
+				for (header * cur = list_next(&lists, freelist); cur != freelist; cur = list_next(&lists, cur)) {
+						if ((char *) cur < heap->chunk || (char *) cur >= end || (uintptr_t) cur % 8 != 0 ||
+										++listed > free_blocks || get_block_state(cur) != UNALLOCATED ||
+										get_freelist_index(&lists, get_block_size(cur)) != i ||
+										list_prev(&lists, cur) == cur || list_next(&lists, list_prev(&lists, cur)) != cur) {
+								return false;
+						}
+				}
+		}
+		return listed == free_blocks;
+}
+
+/**
+ * @brief Helper to take the process shared lock of a heap. If its previous
+ *        owner died while holding it the heap is checked first, and the lock
+ *        is only made consistent again when the heap is intact. Otherwise it
+ *        is released unrecovered so every later attempt fails
+ *
+ * @param heap the shared heap
+ *
+ * @return 0 with the lock held, or an error number without it
+ */
+static int shm_lock(my_shm_heap * heap) {
+		int err = pthread_mutex_lock(&heap->mutex);
+		if (err == EOWNERDEAD) {
+				if (!shm_verify(heap)) {
+						pthread_mutex_unlock(&heap->mutex);
+						return ENOTRECOVERABLE;
+				}
+				pthread_mutex_consistent(&heap->mutex);
+				err = 0;
+		}
+		return err;
+}
+
+my_shm_heap * my_shm_heap_create(int fd, size_t size) {
+		size = size / 8 * 8;
+		size_t chunk_size = size - offsetof(my_shm_heap, chunk);
+		if (size < offsetof(my_shm_heap, chunk) + 2 * ALLOC_HEADER_SIZE + sizeof(header) ||
+						size > SHM_MAX_SIZE) {
+				errno = EINVAL;
+				return NULL;
+		}
+		if (ftruncate(fd, size) != 0) {
+				return NULL;
+		}
+		my_shm_heap * heap = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (heap == MAP_FAILED) {
+				return NULL;
+		}
+		heap->size = size;
+
+		pthread_mutexattr_t attr;
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+		pthread_mutex_init(&heap->mutex, &attr);
+		pthread_mutexattr_destroy(&attr);
+
+		freelist_set lists = shm_lists(heap);
+		for (int i = 0; i < N_LISTS; i++) {
+				header * freelist = &heap->sentinels[i];
+				list_set_next(&lists, freelist, freelist);
+				list_set_prev(&lists, freelist, freelist);
+		}
+
+		// The whole mapping is a single chunk bounded by fenceposts
+		insert_fenceposts(heap->chunk, chunk_size);
+		header * block = get_header_from_offset(heap->chunk, ALLOC_HEADER_SIZE);
+		set_block_size_and_state(block, chunk_size - 2 * ALLOC_HEADER_SIZE, UNALLOCATED);
+		set_left_size(block, ALLOC_HEADER_SIZE);
+		insert_free_block(&lists, block);
+
+		// Publish the heap to attaching processes last
+		__atomic_store_n(&heap->magic, SHM_HEAP_MAGIC, __ATOMIC_RELEASE);
+		return heap;
+}
+
+my_shm_heap * my_shm_heap_attach(int fd) {
+		struct stat st;
+		if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(my_shm_heap)) {
+				errno = EINVAL;
+				return NULL;
+		}
+		my_shm_heap * heap = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (heap == MAP_FAILED) {
+				return NULL;
+		}
+		// Refuse heaps created by a build with a different header layout
+		if (__atomic_load_n(&heap->magic, __ATOMIC_ACQUIRE) != SHM_HEAP_MAGIC ||
+						heap->size != (size_t) st.st_size) {
+				munmap(heap, st.st_size);
+				errno = EINVAL;
+				return NULL;
+		}
+		return heap;
+}
+
+void my_shm_heap_detach(my_shm_heap * heap) {
+		munmap(heap, heap->size);
+}
+
+void * my_shm_malloc(my_shm_heap * heap, size_t size) {
+		if (size == 0) {
+				return NULL;
+		}
+		// Refusing requests whose block size could not be stored
+		if (size > MAX_BLOCK_SIZE - ALLOC_HEADER_SIZE) {
+				errno = ENOMEM;
+				return NULL;
+		}
+		if (size < ALLOC_HEADER_SIZE) {
+				size = ALLOC_HEADER_SIZE;
+		}
+		size_t actual_size = (size + ALLOC_HEADER_SIZE + 7) & ~(size_t) 7;
+		freelist_set lists = shm_lists(heap);
+		int err = shm_lock(heap);
+		if (err != 0) {
+				errno = err;
+				return NULL;
+		}
+		header * block = find_free_block(&lists, actual_size);
+		if (block == NULL) {
+				pthread_mutex_unlock(&heap->mutex);
+				errno = ENOMEM;
+				return NULL;
+		}
+		block = split_free_block(&lists, block, actual_size);
+		pthread_mutex_unlock(&heap->mutex);
+		return get_header_from_offset(block, ALLOC_HEADER_SIZE);
+}
+
+int my_shm_free(my_shm_heap * heap, void * p) {
+		if (p == NULL) {
+				return 0;
+		}
+		header * block = ptr_to_header(p);
+		freelist_set lists = shm_lists(heap);
+		int err = shm_lock(heap);
+		if (err != 0) {
+				errno = err;
+				return -1;
+		}
+		if (get_block_state(block) == UNALLOCATED) {
+				printf("Double Free Detected\n");
+				assert(0);
+		}
+		set_block_state(block, UNALLOCATED);
+		coalesce_free_block(&lists, block);
+		pthread_mutex_unlock(&heap->mutex);
+		return 0;
+}
+
+size_t my_shm_offset(my_shm_heap * heap, void * p) {
+		return (char *) p - (char *) heap;
+}
+
+void * my_shm_pointer(my_shm_heap * heap, size_t offset) {
+		return (char *) heap + offset;
+}
+
+/*
+ * Tagged allocation accounting interface
+ */
+
+/**
+ * @brief Helper to charge a new allocation to a tag. The caller must hold the
+ *        heap mutex, which serializes all updates so readers only need
+ *        relaxed loads
+ *
+ * @param p pointer returned to the user
+ * @param tag tag to charge
+ */
+static inline void account_allocation(void * p, unsigned tag) {
+		header * hdr = ptr_to_header(p);
+		set_block_tag(hdr, tag < MAX_ALLOC_TAGS ? tag : 0);
+		my_tag_stats * stats = &tagStats[get_block_tag(hdr)];
+		__atomic_store_n(&stats->bytes, stats->bytes + get_block_size(hdr) - ALLOC_HEADER_SIZE, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats->count, stats->count + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Helper to credit a block being freed to its tag. The caller must
+ *        hold the heap mutex
+ *
+ * @param hdr header of the allocated block
+ */
+static inline void account_free(header * hdr) {
+		my_tag_stats * stats = &tagStats[get_block_tag(hdr)];
+		__atomic_store_n(&stats->bytes, stats->bytes - (get_block_size(hdr) - ALLOC_HEADER_SIZE), __ATOMIC_RELAXED);
+		__atomic_store_n(&stats->count, stats->count - 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Helper shared by the allocation entry points: take the lock, set the
+ *        heap up on first use, allocate and charge the block to a tag
+ *
+ * @param size number of bytes the user needs
+ * @param tag tag to charge
+ *
+ * @return the allocated memory or NULL
+ */
+static void * locked_allocate(size_t size, unsigned tag) {
+		header * hdr;
+		PERF_MEASURE(PERF_SITE_LOCK, perf_request_bin(size), pthread_mutex_lock(&mutex));
+		if (!isMallocInitialized && !init()) {
+				pthread_mutex_unlock(&mutex);
+				return NULL;
+		}
+		PERF_MEASURE(PERF_SITE_ALLOCATE, perf_request_bin(size), hdr = allocate_object(size));
+		if (hdr != NULL) {
+				account_allocation(hdr, tag);
+		}
+		pthread_mutex_unlock(&mutex);
+		return hdr;
+}
+
+void * my_malloc_tagged(size_t size, unsigned tag) {
+		return locked_allocate(size, tag);
+}
+
+unsigned my_set_alloc_tag(unsigned tag) {
+		unsigned previous = allocTag;
+		allocTag = tag;
+		return previous;
+}
+
+void my_tag_snapshot(my_tag_stats * stats, size_t n) {
+		for (size_t i = 0; i < n && i < MAX_ALLOC_TAGS; i++) {
+				stats[i].bytes = __atomic_load_n(&tagStats[i].bytes, __ATOMIC_RELAXED);
+				stats[i].count = __atomic_load_n(&tagStats[i].count, __ATOMIC_RELAXED);
+		}
+}
+
+/*
+ * Reservation interface
+ */
+
+/**
+ * @brief Helper to fault in the pages of the top block ahead of time. Its
+ *        header is left alone, the rest of a free block holds no data
+ *
+ * @param top the free block in front of lastFencePost
+ */
+static void prefault_block(header * top) {
+		char * start = (char *) top + sizeof(header);
+		char * end = (char *) get_right_header(top);
+		uintptr_t page = sysconf(_SC_PAGESIZE);
+		// The page holding the header is already mapped
+		start = (char *) (((uintptr_t) start + page - 1) & ~(page - 1));
+		if (start >= end) {
+				return;
+		}
+#ifdef MADV_POPULATE_WRITE
+		// Let the kernel populate the whole range in one call when it can
+		if (madvise(start, end - start, MADV_POPULATE_WRITE) == 0) {
+				return;
+		}
+#endif // MADV_POPULATE_WRITE
+		// Otherwise touch every page, the memory is free so its contents do not matter
+		for (volatile char * p = start; p < end; p += page) {
+				*p = 0;
+		}
+}
+
+/*
+ * Most blocks of one size class pre-split by my_reserve. A few per class are
+ * enough to serve the first allocations, more only fragment the top block
+ */
+#define MAX_PRESPLIT_BLOCKS 8
+
+/**
+ * @brief Helper to carve the low end of the top block into a few free blocks
+ *        of every small size class so early allocations find an exact fit
+ *
+ * @param budget most bytes of the top block to split
+ */
+static void presplit_top(size_t budget) {
+		header * top = get_left_header(lastFencePost);
+		if (get_block_state(top) != UNALLOCATED || numLists < 2) {
+				return;
+		}
+		remove_free_block(&heapLists, top);
+		size_t classes = numLists - 1;
+		for (size_t i = 0; i < classes; i++) {
+				size_t size = (i + 1) * 8 + ALLOC_HEADER_SIZE;
+				// Sizes below a full header can never be free blocks
+				if (size < sizeof(header)) {
+						continue;
+				}
+				size_t n = budget / classes / size;
+				for (n = n < MAX_PRESPLIT_BLOCKS ? n : MAX_PRESPLIT_BLOCKS; n > 0; n--) {
+						size_t remaining = get_block_size(top);
+						if (remaining < size + sizeof(header)) {
+								break;
+						}
+						header * block = top;
+						set_block_size_and_state(block, size, UNALLOCATED);
+						top = get_header_from_offset(block, size);
+						set_block_size_and_state(top, remaining - size, UNALLOCATED);
+						set_left_size(top, size);
+						insert_free_block(&heapLists, block);
+				}
+		}
+		set_left_size(lastFencePost, get_block_size(top));
+		insert_free_block(&heapLists, top);
+}
+
+int my_reserve(size_t bytes, int flags) {
+		pthread_mutex_lock(&mutex);
+		if (!isMallocInitialized && !init()) {
+				pthread_mutex_unlock(&mutex);
+				return -1;
+		}
+		// Refusing reservations whose chunk size could not be stored
+		if (bytes > MAX_BLOCK_SIZE - 2 * ALLOC_HEADER_SIZE) {
+				pthread_mutex_unlock(&mutex);
+				errno = ENOMEM;
+				return -1;
+		}
+		size_t actual_size = (bytes + 7) & ~(size_t) 7;
+		if (!NEW_CHUNK_ADDER(actual_size)) {
+				pthread_mutex_unlock(&mutex);
+				errno = ENOMEM;
+				return -1;
+		}
+		if (flags & MEMALC_RESERVE_PREFAULT) {
+				prefault_block(get_left_header(lastFencePost));
+		}
+		if (flags & MEMALC_RESERVE_SPLIT) {
+				presplit_top(bytes / 2);
+		}
+		pthread_mutex_unlock(&mutex);
+		return 0;
+}
+
+int my_mlock_heap() {
+		int result = 0;
+		for (size_t i = 0; i < get_num_os_chunks(); i++) {
+				// The last chunk may grow while unlocked so take its extent under the lock
+				pthread_mutex_lock(&mutex);
+				header * chunk = get_os_chunk(i);
+				header * end = get_os_chunk_end(i);
+				pthread_mutex_unlock(&mutex);
+				if (mlock(chunk, (char *) end + ALLOC_HEADER_SIZE - (char *) chunk) != 0) {
+						result = -1;
+				}
+		}
+		return result;
+}
+
+/* 
+ * External interface
+ */
+void * my_malloc(size_t size) {
+		return locked_allocate(size, allocTag);
+}
+
+void * my_calloc(size_t nmemb, size_t size) {
+		if (size != 0 && nmemb > SIZE_MAX / size) {
+				errno = ENOMEM;
+				return NULL;
+		}
+		void * mem = my_malloc(nmemb * size);
+		if (mem == NULL) {
+				return NULL;
+		}
+		return memset(mem, 0, nmemb * size);
+}
+
+void * my_malloc_sized(size_t size, size_t * actual) {
+		void * hdr = locked_allocate(size, allocTag);
+		if (actual != NULL) {
+				*actual = my_malloc_usable_size(hdr);
+		}
+		return hdr;
+}
+
+size_t my_malloc_usable_size(void * p) {
+		if (p == NULL) {
+				return 0;
+		}
+		return get_block_size(ptr_to_header(p)) - ALLOC_HEADER_SIZE;
+}
+
+void * my_realloc(void * ptr, size_t size) {
+		if (ptr == NULL) {
+				return my_malloc(size);
+		}
+		if (size == 0) {
+				my_free(ptr);
+				return NULL;
+		}
+		size_t old_size = my_malloc_usable_size(ptr);
+		// Shrinking, or growing into the slack left by rounding the original
+		// request, stays in place
+		if (size <= old_size) {
+				pthread_mutex_lock(&mutex);
+				shrink_object(ptr, size);
+				pthread_mutex_unlock(&mutex);
+				return ptr;
+		}
+		// The moved block stays charged to the tag of the original
+		void * mem = locked_allocate(size, get_block_tag(ptr_to_header(ptr)));
+		// The original block stays valid when a larger one cannot be had
+		if (mem == NULL) {
+				return NULL;
+		}
+		memcpy(mem, ptr, old_size);
 		my_free(ptr);
 		return mem; 
 }
 
 void my_free(void * p) {
-		pthread_mutex_lock(&mutex);
-		deallocate_object(p);
+		PERF_MEASURE(PERF_SITE_LOCK, perf_block_bin(p), pthread_mutex_lock(&mutex));
+		PERF_MEASURE(PERF_SITE_DEALLOCATE, perf_block_bin(p), deallocate_object(p));
 		pthread_mutex_unlock(&mutex);
 }
 
 bool verify() {
 		return verify_freelist() && verify_tags();
 }
+
+
+/*
+ * Region interface
+ */
+
+/**
+ * @brief Helper to round a pointer up to the given alignment
+ *
+ * @param ptr pointer to align
+ * @param align alignment in bytes, must be a power of two
+ *
+ * @return the first address at or after ptr that is a multiple of align
+ */
+static inline char * align_up(char * ptr, size_t align) {
+		return (char *) (((uintptr_t) ptr + align - 1) & ~((uintptr_t) align - 1));
+}
+
+/**
+ * @brief Helper to take a new block from the heap and make it the current
+ *        block of a region
+ *
+ * @param r the region to grow
+ * @param min_size the number of usable bytes the block must provide
+ *
+ * @return the new block or NULL if the heap could not provide it
+ */
+static region_block * region_push_block(my_region * r, size_t min_size) {
+		size_t size = r->block_size;
+		if (size < min_size + sizeof(region_block)) {
+				size = min_size + sizeof(region_block);
+		}
+		region_block * block = my_malloc(size);
+		if (block == NULL) {
+				return NULL;
+		}
+		block->prev = r->current;
+		block->end = (char *) block + size;
+		r->current = block;
+		r->cursor = block->data;
+		return block;
+}
+
+/**
+ * @brief Helper to give a chain of region blocks back to the heap while
+ *        holding the lock only once
+ *
+ * @param block the newest block to release
+ * @param stop the first block to keep (NULL releases the whole chain)
+ */
+static void region_release_blocks(region_block * block, region_block * stop) {
+		pthread_mutex_lock(&mutex);
+		while (block != stop) {
+				region_block * prev = block->prev;
+				deallocate_object(block);
+				block = prev;
+		}
+		pthread_mutex_unlock(&mutex);
+}
+
+my_region * my_region_create(size_t block_size) {
+		my_region * r = my_malloc(sizeof(my_region));
+		if (r == NULL) {
+				return NULL;
+		}
+		r->current = NULL;
+		r->cursor = NULL;
+		r->block_size = block_size ? block_size : REGION_BLOCK_SIZE;
+		if (region_push_block(r, 0) == NULL) {
+				my_free(r);
+				return NULL;
+		}
+		return r;
+}
+
+void * my_region_alloc(my_region * r, size_t size, size_t align) {
+		if (size == 0) {
+				return NULL;
+		}
+		if (align < MIN_ALLOCATION) {
+				align = MIN_ALLOCATION;
+		}
+		assert((align & (align - 1)) == 0);
+		// The block needed for the request must not overflow its size
+		if (size > SIZE_MAX - align - sizeof(region_block)) {
+				errno = ENOMEM;
+				return NULL;
+		}
+		char * mem = align_up(r->cursor, align);
+		// Start a new block if the request does not fit in the current one
+		if (mem < r->cursor || mem > r->current->end || size > (size_t) (r->current->end - mem)) {
+				if (region_push_block(r, size + align) == NULL) {
+						return NULL;
+				}
+				mem = align_up(r->cursor, align);
+		}
+		r->cursor = mem + size;
+		return mem;
+}
+
+void my_region_reset(my_region * r) {
+		// Keep the oldest block so the region can be reused without growing
+		region_block * oldest = r->current;
+		while (oldest->prev != NULL) {
+				oldest = oldest->prev;
+		}
+		region_release_blocks(r->current, oldest);
+		r->current = oldest;
+		r->cursor = oldest->data;
+}
+
+void my_region_destroy(my_region * r) {
+		if (r == NULL) {
+				return;
+		}
+		region_release_blocks(r->current, NULL);
+		my_free(r);
+}
+
+my_region_mark my_region_get_mark(my_region * r) {
+		my_region_mark mark = { r->current, r->cursor };
+		return mark;
+}
+
+void my_region_rewind(my_region * r, my_region_mark mark) {
+		region_release_blocks(r->current, mark.block);
+		r->current = mark.block;
+		r->cursor = mark.cursor;
+}
@@ -2,9 +2,19 @@
 #define MY_MALLOC_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
-#define RELATIVE_POINTERS true
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef RELATIVE_POINTERS
+// If not specified at compile time use absolute freelist pointers. Building
+// with -DRELATIVE_POINTERS=true selects the compact header layout which
+// supports heaps of up to 32 GiB and blocks of up to 8 GiB
+#define RELATIVE_POINTERS false
+#endif
 
 #ifndef ARENA_SIZE
 // If not specified at compile time use the default arena size
@@ -21,7 +31,7 @@
  * The size of the normal minus the size of the two free list pointers as
  * they are only maintained while block is free
  */
-#define ALLOC_HEADER_SIZE (sizeof(header) - (2 * sizeof(header *)))
+#define ALLOC_HEADER_SIZE (sizeof(header) - (2 * sizeof(link_t)))
 
 /* The minimum size request the allocator will service */
 #define MIN_ALLOCATION 8
@@ -66,31 +76,127 @@ enum state {
  *
  * char[] data first byte of data pointed to by the list
  */
+#if RELATIVE_POINTERS
+/*
+ * Compact layout: every field is 32 bits wide. Sizes are stored in units of
+ * 8 bytes and freelist links are stored as offsets in units of 8 bytes (see
+ * header_to_link), halving the metadata of a block.
+ */
+typedef uint32_t link_t;
+
+typedef struct __attribute__ ((aligned (8))) header {
+  uint32_t size_and_state;
+  uint32_t left_size;
+  union {
+    // Used when the object is free
+    struct {
+      link_t next;
+      link_t prev;
+    };
+    // Used when the object is allocated
+    char data[0];
+  };
+} header;
+#else
+typedef uintptr_t link_t;
+
 typedef struct header {
   size_t size_and_state;
   size_t left_size;
   union {
     // Used when the object is free
     struct {
-      struct header * next;
-      struct header * prev;
+      link_t next;
+      link_t prev;
     };
     // Used when the object is allocated
     char data[0];
   };
 } header;
+#endif
 
 // Helper functions for getting and storing size and state from header
 // Since the size is a multiple of 8, the last 3 bits are always 0s.
 // Therefore we use the 3 lowest bits to store the state of the object.
 // This is going to save 8 bytes in all objects.
+// With RELATIVE_POINTERS the field holds the size in units of 8 bytes
+// shifted left by 2 to leave room for the state.
+// Otherwise bits TAG_SHIFT and up, which no real size reaches, hold the
+// allocation tag of an allocated block (see my_malloc_tagged).
+
+/* Number of distinct allocation tags */
+#define MAX_ALLOC_TAGS 256
+
+#if !RELATIVE_POINTERS
+#define TAG_SHIFT 48
+#define BLOCK_SIZE_MASK ((((size_t) 1 << TAG_SHIFT) - 1) & ~(size_t) 0x3)
+#endif
+
+/*
+ * Largest block the size field can describe and how far past base the heap
+ * may reach. Compact links count 8 byte units below the encoded sentinels
+ * (see header_to_link), which bounds the heap to 32 GiB.
+ */
+#if RELATIVE_POINTERS
+#define MAX_BLOCK_SIZE (((size_t) UINT32_MAX & ~(size_t) 0x3) << 1)
+#define MAX_HEAP_SPAN ((size_t) SENTINEL_LINK_MIN << 3)
+#else
+#define MAX_BLOCK_SIZE (BLOCK_SIZE_MASK & ~(size_t) 0x7)
+#define MAX_HEAP_SPAN SIZE_MAX
+#endif
+
+#if RELATIVE_POINTERS
+static inline size_t get_block_size(header * h) {
+	return (size_t) (h->size_and_state & ~0x3) << 1;
+}
+
+static inline void set_block_size(header * h, size_t size) {
+	h->size_and_state = (uint32_t) (size >> 1) | (h->size_and_state & 0x3);
+}
+
+static inline size_t get_left_size(header * h) {
+	return (size_t) h->left_size << 3;
+}
 
+static inline void set_left_size(header * h, size_t size) {
+	h->left_size = (uint32_t) (size >> 3);
+}
+#else
 static inline size_t get_block_size(header * h) {
-	return h->size_and_state & ~0x3;
+	return h->size_and_state & BLOCK_SIZE_MASK;
 }
 
 static inline void set_block_size(header * h, size_t size) {
-	h->size_and_state = size | (h->size_and_state & 0x3);
+	h->size_and_state = size | (h->size_and_state & ~BLOCK_SIZE_MASK);
+}
+
+static inline size_t get_left_size(header * h) {
+	return h->left_size;
+}
+
+static inline void set_left_size(header * h, size_t size) {
+	h->left_size = size;
+}
+#endif
+
+// The compact layout has no spare bits, every block carries tag 0
+static inline unsigned get_block_tag(header * h) {
+#if RELATIVE_POINTERS
+	(void) h;
+	return 0;
+#else
+	return (h->size_and_state >> TAG_SHIFT) % MAX_ALLOC_TAGS;
+#endif
+}
+
+static inline void set_block_tag(header * h, unsigned tag) {
+#if RELATIVE_POINTERS
+	(void) h;
+	(void) tag;
+#else
+	h->size_and_state = (h->size_and_state & BLOCK_SIZE_MASK) | (h->size_and_state & 0x3) |
+		((size_t) tag << TAG_SHIFT);
+#endif
 }
 
 static inline enum  state get_block_state(header *h) {
@@ -102,7 +208,8 @@ static inline void set_block_state(header * h, enum state s) {
 }
 
 static inline void set_block_size_and_state(header * h, size_t size, enum state s) {
-	h->size_and_state=(size & ~0x3)|(s &0x3);
+	set_block_size(h, size);
+	set_block_state(h, s);
 }
 
 #define MAX_OS_CHUNKS 1024
@@ -113,6 +220,163 @@ void * my_calloc(size_t nmemb, size_t size);
 void * my_realloc(void * ptr, size_t size);
 void my_free(void * p);
 
+/*
+ * Size returning allocation
+ *
+ * Requests are rounded up and small remainders are handed out with the block,
+ * so a block is often larger than what was asked for. These report the number
+ * of bytes the caller may actually use.
+ */
+void * my_malloc_sized(size_t size, size_t * actual);
+size_t my_malloc_usable_size(void * p);
+
+/*
+ * Region (bump) allocator
+ *
+ * A region carves objects out of large blocks taken from the MeMALC heap by
+ * bumping a cursor. Objects are never freed individually, the whole region is
+ * released with my_region_reset or my_region_destroy. A region is not thread
+ * safe and must only be used by one thread at a time.
+ */
+typedef struct my_region my_region;
+
+/*
+ * A saved position in a region. Rewinding to a mark releases everything
+ * allocated after it was taken, which allows nested scopes.
+ */
+typedef struct my_region_mark {
+  void * block;
+  char * cursor;
+} my_region_mark;
+
+my_region * my_region_create(size_t block_size);
+void * my_region_alloc(my_region * r, size_t size, size_t align);
+void my_region_reset(my_region * r);
+void my_region_destroy(my_region * r);
+my_region_mark my_region_get_mark(my_region * r);
+void my_region_rewind(my_region * r, my_region_mark mark);
+
+/*
+ * Deferred free
+ *
+ * my_free_deferred queues a pointer in a bounded per thread buffer without
+ * taking the heap lock. Queued pointers are freed in address order by
+ * my_free_deferred_flush (the calling thread's buffer, e.g. at a quiet point
+ * of an event loop), my_free_deferred_flush_all (every buffer), the
+ * background reclaimer started with my_start_reclaimer, or when the buffer
+ * fills up or its thread exits. The reclaimer wakes up every interval_us
+ * microseconds, but no more often than every 100.
+ */
+void my_free_deferred(void * p);
+void my_free_deferred_flush();
+void my_free_deferred_flush_all();
+bool my_start_reclaimer(unsigned interval_us);
+void my_stop_reclaimer();
+
+/*
+ * Tagged allocation accounting
+ *
+ * Every allocation from the main heap is charged to a tag below
+ * MAX_ALLOC_TAGS: the one given to my_malloc_tagged or else the calling
+ * thread's current tag set with my_set_alloc_tag (0 by default). Frees credit
+ * the tag stored in the block. my_tag_snapshot copies the live bytes and
+ * block counts of the first n tags without taking the heap lock. Tags out of
+ * range are charged to tag 0, as is everything when built with
+ * RELATIVE_POINTERS whose headers have no room for a tag.
+ */
+typedef struct my_tag_stats {
+  size_t bytes;
+  size_t count;
+} my_tag_stats;
+
+void * my_malloc_tagged(size_t size, unsigned tag);
+unsigned my_set_alloc_tag(unsigned tag);
+void my_tag_snapshot(my_tag_stats * stats, size_t n);
+
+/*
+ * Shared memory heap
+ *
+ * A fixed size heap inside a shared mapping of fd (e.g. from memfd_create or
+ * shm_open), usable by every process that attaches to it. It is guarded by a
+ * process shared robust mutex. Pointers differ between processes, so they
+ * are exchanged as offsets with my_shm_offset and my_shm_pointer. If a
+ * process dies while holding the lock the heap is checked by the next one to
+ * take it. When it was left inconsistent my_shm_malloc returns NULL and
+ * my_shm_free returns -1, both with errno set to ENOTRECOVERABLE, from then
+ * on.
+ */
+typedef struct my_shm_heap my_shm_heap;
+
+my_shm_heap * my_shm_heap_create(int fd, size_t size);
+my_shm_heap * my_shm_heap_attach(int fd);
+void my_shm_heap_detach(my_shm_heap * heap);
+void * my_shm_malloc(my_shm_heap * heap, size_t size);
+int my_shm_free(my_shm_heap * heap, void * p);
+size_t my_shm_offset(my_shm_heap * heap, void * p);
+void * my_shm_pointer(my_shm_heap * heap, size_t offset);
+
+/*
+ * Reservation
+ *
+ * my_reserve grows the heap by at least bytes so later allocations of up to
+ * that much do not need to grow it. MEMALC_RESERVE_PREFAULT also faults in
+ * the new pages and MEMALC_RESERVE_SPLIT pre-splits a few free blocks of
+ * every small size class from them, using at most half of the reservation.
+ * my_mlock_heap locks every chunk of the heap in memory. Both return 0 on
+ * success and -1 with errno set on failure.
+ */
+#define MEMALC_RESERVE_PREFAULT 1
+#define MEMALC_RESERVE_SPLIT 2
+
+int my_reserve(size_t bytes, int flags);
+int my_mlock_heap();
+
+/*
+ * Runtime configuration
+ *
+ * Tunables are read once from the MEMALC_CONF environment variable, written
+ * as comma separated name:value pairs (arena_size, max_growth, n_lists,
+ * deferred_batch), and may be changed with my_mallopt, which returns 1 if
+ * the value was accepted and 0 otherwise. The heap itself is only set up by
+ * the first allocation, so MEMALC_N_LISTS must be set before it.
+ */
+#define MEMALC_ARENA_SIZE 1     // granularity and first step of heap growth
+#define MEMALC_MAX_GROWTH 2     // cap on the geometric growth of the heap
+#define MEMALC_N_LISTS 3        // number of freelists in use, at most N_LISTS
+#define MEMALC_DEFERRED_BATCH 4 // queued deferred frees that force a flush
+
+int my_mallopt(int param, size_t value);
+
+// Write the hardware counter totals gathered when built with -DPERF_COUNTERS
+// to a file descriptor, one line per live thread, site and bin followed by
+// the totals of all exited threads under the tid "exited". Every instrumented
+// call reads the counters with extra system calls, four per my_malloc
+void my_perf_dump(int fd);
+
+/*
+ * Heap walk
+ *
+ * my_heap_walk reports every block of every chunk from the OS, in address
+ * order, until the callback returns false. Blocks are collected in small
+ * batches under the lock and reported after it is released, so callbacks may
+ * allocate but must not start another walk. Walks are serialized. The heap
+ * may change between batches: a block merged into one that was already
+ * reported is reported again in its merged form. my_heap_dump writes one
+ * line per chunk holding its offset from base followed by runs of
+ * neighbouring blocks in the same state, written as <U|A|F><bytes>/<blocks>.
+ */
+typedef struct my_heap_block {
+  void * addr;
+  size_t size;
+  enum state state;
+  size_t chunk;
+} my_heap_block;
+
+typedef bool (*my_heap_walk_fn)(const my_heap_block * block, void * ctx);
+
+void my_heap_walk(my_heap_walk_fn callback, void * ctx);
+void my_heap_dump(int fd);
+
 // Debug list verifitcation
 bool verify();
 
@@ -131,4 +395,67 @@ extern char freelist_bitmap[];
 extern header * osChunkList[];
 extern size_t numOsChunks;
 
+// Helper functions for following and updating the freelist links of a block
+
+/*
+ * Links are stored relative to a link base so that a heap can live at a
+ * different address in every process mapping it: the start of the mapping
+ * for a shared memory heap, base for the compact main heap and address 0
+ * (plain pointers) otherwise. HEAP_LINK_BASE is the one of the main heap.
+ */
+#if RELATIVE_POINTERS
+/*
+ * Links are offsets in units of 8 bytes. The sentinels of the main heap live
+ * outside of it so they are encoded at the top of the offset range, sentinel
+ * i being stored as UINT32_MAX - i.
+ */
+#define SENTINEL_LINK_MIN ((link_t) (UINT32_MAX - (N_LISTS - 1)))
+#define HEAP_LINK_BASE ((char *) base)
+
+static inline link_t header_to_link(char * link_base, header * h) {
+	uintptr_t sentinel = (uintptr_t) h - (uintptr_t) freelistSentinels;
+	if (sentinel < N_LISTS * sizeof(header)) {
+		return UINT32_MAX - (link_t) (sentinel / sizeof(header));
+	}
+	return (link_t) (((char *) h - link_base) >> 3);
+}
+
+static inline header * link_to_header(char * link_base, link_t l) {
+	if (l >= SENTINEL_LINK_MIN) {
+		return &freelistSentinels[UINT32_MAX - l];
+	}
+	return (header *) (link_base + ((size_t) l << 3));
+}
+#else
+#define HEAP_LINK_BASE ((char *) NULL)
+
+static inline link_t header_to_link(char * link_base, header * h) {
+	return (uintptr_t) h - (uintptr_t) link_base;
+}
+
+static inline header * link_to_header(char * link_base, link_t l) {
+	return (header *) ((uintptr_t) link_base + l);
+}
+#endif
+
+static inline header * get_next(header * h) {
+	return link_to_header(HEAP_LINK_BASE, h->next);
+}
+
+static inline void set_next(header * h, header * next) {
+	h->next = header_to_link(HEAP_LINK_BASE, next);
+}
+
+static inline header * get_prev(header * h) {
+	return link_to_header(HEAP_LINK_BASE, h->prev);
+}
+
+static inline void set_prev(header * h, header * prev) {
+	h->prev = header_to_link(HEAP_LINK_BASE, prev);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif // MY_MALLOC_H
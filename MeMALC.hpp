@@ -0,0 +1,229 @@
+#ifndef MY_MALLOC_HPP
+#define MY_MALLOC_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory_resource>
+#include <new>
+
+#include "MeMALC.h"
+
+/*
+ * Header only C++ adapters over MeMALC
+ *
+ * memalc::memory_resource and memalc::allocator<T> allocate from the main
+ * heap, memalc::region_resource from a region (see my_region_create) and
+ * memalc::shm_resource from a shared memory heap (see my_shm_heap_create).
+ */
+namespace memalc {
+
+namespace detail {
+
+/* Blocks are always aligned to this many bytes */
+constexpr std::size_t natural_alignment = MIN_ALLOCATION;
+
+/**
+ * @brief Allocate from a MeMALC heap with any power of two alignment
+ *
+ * Stricter alignments than natural_alignment over-allocate and keep the
+ * pointer returned by the heap just in front of the aligned one
+ *
+ * @param alloc function allocating a number of bytes or returning NULL
+ * @param bytes number of bytes needed
+ * @param alignment required alignment
+ *
+ * @return the allocated memory, throws std::bad_alloc on failure
+ */
+template <class Alloc>
+inline void * allocate(Alloc alloc, std::size_t bytes, std::size_t alignment) {
+	// The heaps return NULL for empty requests
+	if (bytes == 0) {
+		bytes = 1;
+	}
+	if (alignment <= natural_alignment) {
+		void * p = alloc(bytes);
+		if (p == nullptr) {
+			throw std::bad_alloc();
+		}
+		return p;
+	}
+	if (bytes > std::numeric_limits<std::size_t>::max() - alignment - sizeof(void *)) {
+		throw std::bad_alloc();
+	}
+	void * raw = alloc(bytes + alignment + sizeof(void *));
+	if (raw == nullptr) {
+		throw std::bad_alloc();
+	}
+	std::uintptr_t aligned = (reinterpret_cast<std::uintptr_t>(raw) + sizeof(void *) + alignment - 1)
+			& ~(static_cast<std::uintptr_t>(alignment) - 1);
+	reinterpret_cast<void **>(aligned)[-1] = raw;
+	return reinterpret_cast<void *>(aligned);
+}
+
+/**
+ * @brief Free memory returned by allocate
+ *
+ * @param free function freeing a pointer returned by the heap
+ * @param p the memory to free
+ * @param alignment the alignment it was allocated with
+ */
+template <class Free>
+inline void deallocate(Free free, void * p, std::size_t alignment) noexcept {
+	if (alignment <= natural_alignment) {
+		free(p);
+	} else {
+		free(static_cast<void **>(p)[-1]);
+	}
+}
+
+inline void * heap_allocate(std::size_t bytes, std::size_t alignment) {
+	return allocate(my_malloc, bytes, alignment);
+}
+
+inline void heap_deallocate(void * p, std::size_t alignment) noexcept {
+	deallocate(my_free, p, alignment);
+}
+
+} // namespace detail
+
+/*
+ * Polymorphic memory resource over the main MeMALC heap. All instances are
+ * interchangeable, get_memory_resource returns a shared one.
+ */
+class memory_resource : public std::pmr::memory_resource {
+protected:
+	void * do_allocate(std::size_t bytes, std::size_t alignment) override {
+		return detail::heap_allocate(bytes, alignment);
+	}
+
+	// Blocks carry their own size so the size passed in is not needed
+	void do_deallocate(void * p, std::size_t, std::size_t alignment) override {
+		detail::heap_deallocate(p, alignment);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource & other) const noexcept override {
+		return dynamic_cast<const memory_resource *>(&other) != nullptr;
+	}
+};
+
+inline memory_resource * get_memory_resource() noexcept {
+	static memory_resource resource;
+	return &resource;
+}
+
+/*
+ * Stateless standard allocator over the main MeMALC heap
+ */
+template <class T>
+class allocator {
+public:
+	using value_type = T;
+
+	allocator() noexcept = default;
+
+	template <class U>
+	allocator(const allocator<U> &) noexcept {}
+
+	T * allocate(std::size_t n) {
+		if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+			throw std::bad_array_new_length();
+		}
+		return static_cast<T *>(detail::heap_allocate(n * sizeof(T), alignof(T)));
+	}
+
+	void deallocate(T * p, std::size_t) noexcept {
+		detail::heap_deallocate(p, alignof(T));
+	}
+};
+
+template <class T, class U>
+inline bool operator==(const allocator<T> &, const allocator<U> &) noexcept {
+	return true;
+}
+
+template <class T, class U>
+inline bool operator!=(const allocator<T> &, const allocator<U> &) noexcept {
+	return false;
+}
+
+/*
+ * Polymorphic memory resource owning a MeMALC region. Deallocation does
+ * nothing, memory is given back all at once by release or the destructor.
+ */
+class region_resource : public std::pmr::memory_resource {
+public:
+	explicit region_resource(std::size_t block_size = 0) : region_(my_region_create(block_size)) {
+		if (region_ == nullptr) {
+			throw std::bad_alloc();
+		}
+	}
+
+	region_resource(const region_resource &) = delete;
+	region_resource & operator=(const region_resource &) = delete;
+
+	~region_resource() override {
+		my_region_destroy(region_);
+	}
+
+	void release() noexcept {
+		my_region_reset(region_);
+	}
+
+	my_region * region() const noexcept {
+		return region_;
+	}
+
+protected:
+	void * do_allocate(std::size_t bytes, std::size_t alignment) override {
+		void * p = my_region_alloc(region_, bytes == 0 ? 1 : bytes, alignment);
+		if (p == nullptr) {
+			throw std::bad_alloc();
+		}
+		return p;
+	}
+
+	void do_deallocate(void *, std::size_t, std::size_t) override {}
+
+	bool do_is_equal(const std::pmr::memory_resource & other) const noexcept override {
+		return this == &other;
+	}
+
+private:
+	my_region * region_;
+};
+
+/*
+ * Polymorphic memory resource over a shared memory heap. The heap is not
+ * owned, it stays attached after the resource is destroyed.
+ */
+class shm_resource : public std::pmr::memory_resource {
+public:
+	explicit shm_resource(my_shm_heap * heap) noexcept : heap_(heap) {}
+
+	my_shm_heap * heap() const noexcept {
+		return heap_;
+	}
+
+protected:
+	void * do_allocate(std::size_t bytes, std::size_t alignment) override {
+		return detail::allocate([this](std::size_t n) { return my_shm_malloc(heap_, n); },
+				bytes, alignment);
+	}
+
+	void do_deallocate(void * p, std::size_t, std::size_t alignment) override {
+		detail::deallocate([this](void * q) { my_shm_free(heap_, q); }, p, alignment);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource & other) const noexcept override {
+		auto * shm = dynamic_cast<const shm_resource *>(&other);
+		return shm != nullptr && shm->heap_ == heap_;
+	}
+
+private:
+	my_shm_heap * heap_;
+};
+
+} // namespace memalc
+
+#endif // MY_MALLOC_HPP
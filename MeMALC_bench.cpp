@@ -0,0 +1,127 @@
+/*
+ * Compares container workloads on the MeMALC adapters of MeMALC.hpp against
+ * the default allocator
+ *
+ * c++ -std=c++17 -O2 -I. MeMALC_bench.cpp MeMALC.o printing.o -lpthread
+ *
+ * Every workload runs ROUNDS times per allocator and prints the average wall
+ * clock time per operation:
+ *   unordered_map  insert N keys, look each up, erase them again
+ *   vector         push_back N heap allocated strings into N / 100 vectors,
+ *                  then free them
+ *
+ * When both are built with -DPERF_COUNTERS the hardware counter totals of
+ * my_perf_dump follow each workload. They accumulate over the whole run.
+ */
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "MeMALC.hpp"
+
+namespace {
+
+constexpr int N = 200000;
+constexpr int ROUNDS = 5;
+
+// Keeps the optimizer from discarding the results of a workload
+volatile std::size_t sink;
+
+template <class Map>
+void map_workload(Map & map) {
+	for (int i = 0; i < N; i++) {
+		map.emplace(i * 7919, i);
+	}
+	std::size_t found = 0;
+	for (int i = 0; i < N; i++) {
+		found += map.count(i * 7919);
+	}
+	for (int i = 0; i < N; i++) {
+		map.erase(i * 7919);
+	}
+	sink = found;
+}
+
+template <class Vector, class String>
+void vector_workload(std::function<Vector()> make_vector, std::function<String(const char *)> make_string) {
+	std::vector<Vector> vectors;
+	vectors.reserve(N / 100);
+	for (int i = 0; i < N / 100; i++) {
+		vectors.push_back(make_vector());
+		for (int j = 0; j < 100; j++) {
+			vectors.back().push_back(make_string("a string longer than the small buffer"));
+		}
+	}
+	sink = vectors.size();
+}
+
+/*
+ * Run a workload ROUNDS times and print the average time per operation
+ */
+void report(const char * workload, const char * allocator, long operations, std::function<void()> run) {
+	auto start = std::chrono::steady_clock::now();
+	for (int round = 0; round < ROUNDS; round++) {
+		run();
+	}
+	std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+	std::printf("%-14s %-24s %8.1f ns/op\n", workload, allocator, elapsed.count() / ROUNDS / operations);
+}
+
+/*
+ * Print the counter totals gathered so far
+ */
+void dump_counters(const char * workload) {
+#ifdef PERF_COUNTERS
+	std::printf("counters after %s\n", workload);
+	std::fflush(stdout);
+	my_perf_dump(STDOUT_FILENO);
+#else
+	(void) workload;
+#endif // PERF_COUNTERS
+}
+
+} // namespace
+
+int main() {
+	using memalc_pair = memalc::allocator<std::pair<const int, int>>;
+	report("unordered_map", "std::allocator", 3L * N, [] {
+		std::unordered_map<int, int> map;
+		map_workload(map);
+	});
+	report("unordered_map", "memalc::allocator", 3L * N, [] {
+		std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, memalc_pair> map;
+		map_workload(map);
+	});
+	report("unordered_map", "memalc::memory_resource", 3L * N, [] {
+		std::pmr::unordered_map<int, int> map(memalc::get_memory_resource());
+		map_workload(map);
+	});
+	dump_counters("unordered_map");
+
+	using memalc_string = std::basic_string<char, std::char_traits<char>, memalc::allocator<char>>;
+	using memalc_vector = std::vector<memalc_string, memalc::allocator<memalc_string>>;
+	report("vector", "std::allocator", N, [] {
+		vector_workload<std::vector<std::string>, std::string>(
+				[] { return std::vector<std::string>(); },
+				[](const char * s) { return std::string(s); });
+	});
+	report("vector", "memalc::allocator", N, [] {
+		vector_workload<memalc_vector, memalc_string>(
+				[] { return memalc_vector(); },
+				[](const char * s) { return memalc_string(s); });
+	});
+	report("vector", "memalc::memory_resource", N, [] {
+		std::pmr::memory_resource * resource = memalc::get_memory_resource();
+		vector_workload<std::pmr::vector<std::pmr::string>, std::pmr::string>(
+				[resource] { return std::pmr::vector<std::pmr::string>(resource); },
+				[resource](const char * s) { return std::pmr::string(s, resource); });
+	});
+	dump_counters("vector");
+	return 0;
+}
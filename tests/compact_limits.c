@@ -0,0 +1,97 @@
+/*
+ * Checks that the heap stays within the limits of its header layout: requests
+ * for blocks larger than MAX_BLOCK_SIZE are refused, no block ever grows past
+ * it by coalescing or by heap growth, and the heap never reaches further than
+ * MAX_HEAP_SPAN from base. Meant for the compact layout, where the limits are
+ * 8 GiB and 32 GiB. Only address space is used, the memory is never touched.
+ *
+ * cc -DRELATIVE_POINTERS=true -I.. ../MeMALC.c ../printing.c compact_limits.c -lpthread
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "MeMALC.h"
+
+#define GIB ((size_t) 1 << 30)
+#define MAX_BLOCKS 40
+
+static int failures;
+
+#define CHECK(cond) \
+		do { \
+				if (!(cond)) { \
+						fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+						failures++; \
+				} \
+		} while (0)
+
+/*
+ * my_heap_walk callback checking the size and the boundary tags of a block
+ * and recording the end of the heap
+ */
+static bool check_block(const my_heap_block * block, void * ctx) {
+		char ** heap_end = ctx;
+		header * h = block->addr;
+		CHECK(block->size <= MAX_BLOCK_SIZE);
+		CHECK(get_left_size(get_right_header(h)) == block->size);
+		if ((char *) get_right_header(h) > *heap_end) {
+				*heap_end = (char *) get_right_header(h);
+		}
+		return true;
+}
+
+/*
+ * Walk the whole heap and check every block
+ */
+static void check_heap() {
+		char * heap_end = base;
+		my_heap_walk(check_block, &heap_end);
+		CHECK((size_t) (heap_end - (char *) base) <= MAX_HEAP_SPAN);
+}
+
+int main() {
+		void * blocks[MAX_BLOCKS];
+		size_t n;
+
+		// Requests whose block cannot be described are refused up front
+		errno = 0;
+		CHECK(my_malloc(MAX_BLOCK_SIZE) == NULL);
+		CHECK(errno == ENOMEM);
+		CHECK(my_malloc(MAX_BLOCK_SIZE + GIB) == NULL);
+		CHECK(my_malloc(SIZE_MAX) == NULL);
+
+		// Grow the heap in large steps until the OS or the layout says no
+		my_mallopt(MEMALC_MAX_GROWTH, 4 * GIB);
+		for (n = 0; n < MAX_BLOCKS; n++) {
+				blocks[n] = my_malloc(GIB);
+				if (blocks[n] == NULL) {
+						break;
+				}
+		}
+		printf("allocated %zu blocks of 1 GiB\n", n);
+		check_heap();
+
+		// Freeing neighbours must not merge them past the block limit
+		for (size_t i = 0; i < n; i++) {
+				my_free(blocks[i]);
+		}
+		check_heap();
+
+		// The freed space is still usable
+		for (size_t i = 0; i < n; i++) {
+				blocks[i] = my_malloc(GIB);
+				CHECK(blocks[i] != NULL);
+		}
+		for (size_t i = 0; i < n; i++) {
+				my_free(blocks[i]);
+		}
+		check_heap();
+
+		if (failures != 0) {
+				fprintf(stderr, "%d checks failed\n", failures);
+				return 1;
+		}
+		printf("ok\n");
+		return 0;
+}
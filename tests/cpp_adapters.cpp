@@ -0,0 +1,139 @@
+/*
+ * Exercises the C++ adapters of MeMALC.hpp: the standard allocator with
+ * ordinary and over-aligned types, the polymorphic resource over the main
+ * heap, and the region and shared memory resources.
+ *
+ * cc -c -I.. ../MeMALC.c ../printing.c
+ * c++ -std=c++17 -I.. cpp_adapters.cpp MeMALC.o printing.o -lpthread
+ */
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory_resource>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+#include "MeMALC.hpp"
+
+static int failures;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			std::fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+struct alignas(64) cache_line {
+	char bytes[64];
+};
+
+template <class T>
+static bool is_aligned(const T * p, std::size_t alignment) {
+	return reinterpret_cast<std::uintptr_t>(p) % alignment == 0;
+}
+
+static void test_allocator() {
+	std::vector<int, memalc::allocator<int>> numbers;
+	for (int i = 0; i < 10000; i++) {
+		numbers.push_back(i);
+	}
+	long sum = 0;
+	for (int n : numbers) {
+		sum += n;
+	}
+	CHECK(sum == 49995000L);
+
+	using pair_allocator = memalc::allocator<std::pair<const int, std::string>>;
+	std::map<int, std::string, std::less<int>, pair_allocator> names;
+	for (int i = 0; i < 1000; i++) {
+		names[i] = std::to_string(i);
+	}
+	names.erase(names.begin(), names.find(500));
+	CHECK(names.size() == 500 && names.begin()->second == "500");
+
+	// Stricter alignments than the heap's own are honoured
+	std::vector<cache_line, memalc::allocator<cache_line>> lines(100);
+	CHECK(is_aligned(lines.data(), alignof(cache_line)));
+	memalc::allocator<cache_line> alloc;
+	cache_line * line = alloc.allocate(3);
+	CHECK(is_aligned(line, alignof(cache_line)));
+	alloc.deallocate(line, 3);
+
+	CHECK(memalc::allocator<int>() == memalc::allocator<char>());
+}
+
+static void test_memory_resource() {
+	std::pmr::memory_resource * resource = memalc::get_memory_resource();
+	CHECK(resource->is_equal(memalc::memory_resource()));
+	std::pmr::vector<std::pmr::string> words(resource);
+	for (int i = 0; i < 1000; i++) {
+		words.emplace_back(40, static_cast<char>('a' + i % 26));
+	}
+	CHECK(words[27].size() == 40 && words[27].front() == 'b');
+	CHECK(words.get_allocator().resource() == resource);
+
+	void * p = resource->allocate(100, 256);
+	CHECK(is_aligned(p, 256));
+	resource->deallocate(p, 100, 256);
+}
+
+static void test_region_resource() {
+	memalc::region_resource region(4096);
+	std::pmr::vector<int> numbers(&region);
+	for (int i = 0; i < 10000; i++) {
+		numbers.push_back(i);
+	}
+	CHECK(numbers.back() == 9999);
+	void * p = region.allocate(10, 128);
+	CHECK(is_aligned(p, 128));
+	CHECK(!region.is_equal(*memalc::get_memory_resource()));
+	numbers.clear();
+	numbers.shrink_to_fit();
+	region.release();
+}
+
+static void test_shm_resource() {
+	int fd = memfd_create("cpp_adapters", 0);
+	CHECK(fd >= 0);
+	if (fd < 0) {
+		return;
+	}
+	my_shm_heap * heap = my_shm_heap_create(fd, 1 << 20);
+	CHECK(heap != nullptr);
+	if (heap == nullptr) {
+		close(fd);
+		return;
+	}
+	memalc::shm_resource resource(heap);
+	{
+		std::pmr::vector<long> numbers(&resource);
+		for (long i = 0; i < 1000; i++) {
+			numbers.push_back(i * i);
+		}
+		CHECK(numbers[999] == 998001L);
+		// The vector's storage lives inside the mapping
+		std::size_t offset = my_shm_offset(heap, numbers.data());
+		CHECK(offset > 0 && offset < (1 << 20));
+		CHECK(my_shm_pointer(heap, offset) == numbers.data());
+	}
+	CHECK(resource.is_equal(memalc::shm_resource(heap)));
+	my_shm_heap_detach(heap);
+	close(fd);
+}
+
+int main() {
+	test_allocator();
+	test_memory_resource();
+	test_region_resource();
+	test_shm_resource();
+	if (failures != 0) {
+		std::fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	std::printf("ok\n");
+	return 0;
+}
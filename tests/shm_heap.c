@@ -0,0 +1,127 @@
+/*
+ * Exercises the shared memory heap: a child process attaches and allocates,
+ * the parent reads the blocks back through their offsets and frees them,
+ * and the heap is filled and drained again. Requests whose block size could
+ * not be stored are refused without touching the heap.
+ *
+ * cc -I.. ../MeMALC.c ../printing.c shm_heap.c -lpthread
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "MeMALC.h"
+
+#define HEAP_SIZE ((size_t) 1 << 20)
+#define MESSAGES 100
+#define MAX_BLOCKS 2000
+
+static int failures;
+
+#define CHECK(cond) \
+		do { \
+				if (!(cond)) { \
+						fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+						failures++; \
+				} \
+		} while (0)
+
+/*
+ * Fill the heap with blocks of size bytes and free them all again
+ *
+ * @return the number of blocks that fit
+ */
+static size_t fill_and_drain(my_shm_heap * heap, size_t size) {
+		static void * blocks[MAX_BLOCKS];
+		size_t n = 0;
+		while (n < MAX_BLOCKS && (blocks[n] = my_shm_malloc(heap, size)) != NULL) {
+				memset(blocks[n], 0xa5, size);
+				n++;
+		}
+		for (size_t i = 0; i < n; i++) {
+				CHECK(my_shm_free(heap, blocks[i]) == 0);
+		}
+		return n;
+}
+
+/*
+ * Requests too large to describe must fail with ENOMEM
+ */
+static void check_refused(my_shm_heap * heap, size_t size) {
+		errno = 0;
+		CHECK(my_shm_malloc(heap, size) == NULL);
+		CHECK(errno == ENOMEM);
+}
+
+int main() {
+		int fd = memfd_create("shm_heap", 0);
+		CHECK(fd >= 0);
+		my_shm_heap * heap = my_shm_heap_create(fd, HEAP_SIZE);
+		CHECK(heap != NULL);
+		if (heap == NULL) {
+				return 1;
+		}
+		size_t * offsets = mmap(NULL, MESSAGES * sizeof(size_t), PROT_READ | PROT_WRITE,
+						MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		CHECK(offsets != MAP_FAILED);
+
+		size_t before = fill_and_drain(heap, 1000);
+		CHECK(before > 0);
+
+		// A second process attaches and leaves messages behind
+		pid_t pid = fork();
+		if (pid == 0) {
+				my_shm_heap * child = my_shm_heap_attach(fd);
+				if (child == NULL) {
+						_exit(1);
+				}
+				for (int i = 0; i < MESSAGES; i++) {
+						char * p = my_shm_malloc(child, 100 + i);
+						if (p == NULL) {
+								_exit(1);
+						}
+						sprintf(p, "message %d", i);
+						offsets[i] = my_shm_offset(child, p);
+				}
+				my_shm_heap_detach(child);
+				_exit(0);
+		}
+		int status;
+		CHECK(waitpid(pid, &status, 0) == pid);
+		CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+		for (int i = 0; i < MESSAGES; i++) {
+				char expected[32];
+				char * p = my_shm_pointer(heap, offsets[i]);
+				sprintf(expected, "message %d", i);
+				CHECK(strcmp(p, expected) == 0);
+				CHECK(my_shm_free(heap, p) == 0);
+		}
+		CHECK(my_shm_free(heap, NULL) == 0);
+
+		// Oversized requests leave the heap as it was
+		check_refused(heap, SIZE_MAX);
+		check_refused(heap, SIZE_MAX - 20);
+		check_refused(heap, MAX_BLOCK_SIZE);
+		check_refused(heap, HEAP_SIZE);
+
+		// Everything freed merged back, so the heap holds as much as before
+		CHECK(fill_and_drain(heap, 1000) == before);
+		void * big = my_shm_malloc(heap, HEAP_SIZE / 2);
+		CHECK(big != NULL);
+		CHECK(my_shm_free(heap, big) == 0);
+
+		my_shm_heap_detach(heap);
+		close(fd);
+		if (failures != 0) {
+				fprintf(stderr, "%d checks failed\n", failures);
+				return 1;
+		}
+		printf("ok\n");
+		return 0;
+}